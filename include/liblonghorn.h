@@ -1,12 +1,362 @@
 #ifndef LIBLONGHORN_HEADER
 #define LIBLONGHORN_HEADER
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The library is built with hidden visibility, only what is declared here
+ * is exported from liblonghorn.so.
+ */
+#pragma GCC visibility push(default)
+
+/*
+ * Priority classes for the submission scheduler. Classes share the socket
+ * by deficit round-robin, weighted by their quantum in bytes.
+ */
+enum lh_client_prio {
+        LH_CLIENT_PRIO_LATENCY = 0,
+        LH_CLIENT_PRIO_NORMAL,
+        LH_CLIENT_PRIO_BULK,
+        LH_CLIENT_PRIO_CLASSES,
+};
+
+/*
+ * Retry policy for dialing the replica socket. The delay before attempt n+1
+ * is min(initial_delay_ms * multiplier^n, max_delay_ms), reduced by a random
+ * amount of up to jitter_pct percent.
+ */
+struct lh_client_backoff {
+        int max_attempts;
+        int initial_delay_ms;
+        int max_delay_ms;
+        double multiplier;
+        int jitter_pct;
+};
+
+/*
+ * Token bucket limits, 0 rates are unlimited. The burst values are how many
+ * requests or bytes may be issued back to back on top of the rate.
+ */
+struct lh_client_qos {
+        uint64_t iops;
+        uint64_t iops_burst;
+        uint64_t bps;
+        uint64_t bps_burst;
+};
+
+/*
+ * Bound on the requests in flight on a connection. With target_latency_us
+ * set the bound adapts between min_depth and max_depth: it grows by one
+ * per round trip while completions stay under the target and halves when
+ * they don't.
+ */
+struct lh_client_queue_depth {
+        int max_depth;          // 0 unlimited
+        int nonblock;           // fail submissions with -EAGAIN when full
+        int min_depth;
+        int target_latency_us;  // 0 disables adaptive sizing
+};
+
+struct lh_client_stats {
+        uint64_t reconnects;
+        uint64_t reconnect_failures;
+        uint64_t replayed_requests;
+        uint64_t last_reconnect_latency_us;
+        uint64_t max_reconnect_latency_us;
+        uint64_t total_reconnect_latency_us;
+        uint64_t throttled_requests;
+        uint64_t throttle_delay_us;
+        uint64_t queue_full_rejections;
+        uint64_t queue_depth;   // current in-flight bound, 0 unlimited
+        uint64_t unmaps_coalesced; // unmaps that rode along another's run
+};
+
 struct lh_client_conn *lh_client_allocate_conn(int request_timeout);
 void lh_client_free_conn(struct lh_client_conn *conn);
 int lh_client_open_conn(struct lh_client_conn *conn, char *socket_path);
 int lh_client_close_conn(struct lh_client_conn *conn);
 
+/*
+ * Open the connection from a helper thread. Returns a file descriptor that
+ * becomes readable once the open has finished, then
+ * lh_client_open_conn_finish() returns the result of the open and releases
+ * the descriptor. It must be called before any other use of the connection.
+ */
+int lh_client_open_conn_async(struct lh_client_conn *conn, char *socket_path);
+int lh_client_open_conn_finish(struct lh_client_conn *conn);
+
+/*
+ * Without an explicit policy, opening retries retry_counts times every
+ * retry_interval seconds.
+ */
+extern int retry_interval;
+extern int retry_counts;
+
+int lh_client_set_open_backoff(struct lh_client_conn *conn,
+                const struct lh_client_backoff *backoff);
+
+/*
+ * Re-dial the socket when the connection breaks, retrying up to max_retries
+ * times with exponential backoff between initial_delay_ms and max_delay_ms.
+ * Pending requests are replayed on the new socket.  max_retries 0 disables.
+ */
+int lh_client_set_reconnect(struct lh_client_conn *conn, int max_retries,
+                int initial_delay_ms, int max_delay_ms);
+int lh_client_set_reconnect_backoff(struct lh_client_conn *conn,
+                const struct lh_client_backoff *backoff);
+int lh_client_get_stats(struct lh_client_conn *conn, struct lh_client_stats *stats);
+
 int lh_client_read_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset);
 int lh_client_write_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset);
 int lh_client_unmap(struct lh_client_conn *conn, void *buf, size_t count, off_t offset);
+
+/*
+ * Reads and writes larger than segment_size (1MiB by default) are split
+ * into segments that are pipelined on the socket. 0 disables splitting.
+ */
+int lh_client_set_segment_size(struct lh_client_conn *conn, size_t segment_size);
+
+/*
+ * Synchronous callers poll for their completion for up to spin_us before
+ * going to sleep, trading CPU for wakeup latency. 0, the default, sleeps
+ * right away.
+ */
+int lh_client_set_completion_spin(struct lh_client_conn *conn, int spin_us);
+
+/*
+ * Low latency mode for fast replicas: while requests are outstanding the
+ * response thread polls the socket without blocking for up to budget_us
+ * before it sleeps in read(). Pair with lh_client_set_completion_spin()
+ * and pin the response thread to a CPU of its own; the CPU is applied
+ * when the connection is opened, -1 unpins.
+ */
+int lh_client_set_busy_poll(struct lh_client_conn *conn, int budget_us);
+int lh_client_set_response_cpu(struct lh_client_conn *conn, int cpu);
+
+/*
+ * Optional protocol extensions. Ask for them before opening; they are
+ * negotiated whenever the connection is opened or reconnects, and
+ * lh_client_get_features() returns the ones the replica last accepted.
+ * Replicas that predate negotiation answer with an error, or not at all
+ * within a second, and get none.
+ */
+#define LH_CLIENT_FEATURE_SPARSE_READ   0x1
+#define LH_CLIENT_FEATURE_EXTENTS       0x2
+#define LH_CLIENT_FEATURE_REQUEST_FLAGS 0x4
+
+int lh_client_set_features(struct lh_client_conn *conn, uint32_t features);
+int lh_client_get_features(struct lh_client_conn *conn);
+
+/*
+ * A range of the volume. flags 0 is data; holes and zero ranges read as
+ * zeros.
+ */
+#define LH_CLIENT_EXTENT_HOLE   0x1
+#define LH_CLIENT_EXTENT_ZERO   0x2
+
+struct lh_client_extent {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t flags;
+};
+
+/*
+ * Read like lh_client_read_at() and describe the range as sorted extents,
+ * neighbours of the same kind merged. With sparse reads negotiated the
+ * replica sends no bytes for holes and zero ranges, they are zeroed
+ * locally; otherwise the whole range is data up to the end of the volume
+ * and a hole past it. Returns the number of extents, or -E2BIG when more
+ * than max_extents were needed, in which case buf is still filled in.
+ */
+int lh_client_read_sparse(struct lh_client_conn *conn, void *buf, size_t count,
+                off_t offset, struct lh_client_extent *extents, int max_extents);
+
+/*
+ * Describe length bytes from offset without reading them, in the spirit
+ * of SEEK_DATA/SEEK_HOLE. Needs LH_CLIENT_FEATURE_EXTENTS, -EOPNOTSUPP
+ * otherwise. Returns the number of extents filled in; when max_extents
+ * runs out first they cover only the start of the range, continue from
+ * the end of the last one.
+ */
+int lh_client_get_extents(struct lh_client_conn *conn, off_t offset,
+                uint64_t length, struct lh_client_extent *extents, int max_extents);
+
+/*
+ * Hand socket writes to a sender thread. Submitters queue their requests
+ * without taking the connection lock and never block on the socket, the
+ * sender writes whatever piled up in large vectored writes. Pays off with
+ * many submitting threads. Applied when the connection is opened.
+ */
+int lh_client_set_sender_thread(struct lh_client_conn *conn, int enable);
+
+/*
+ * Coalesce unmaps: they are held for up to window_us after the first one
+ * arrives, or until max_bytes are pending, then adjacent and overlapping
+ * ranges go out as one TypeUnmap each. Every caller completes with its
+ * run. Reads and writes are not held. A window of 0, the default,
+ * disables it; max_bytes 0 means no cap. Applied when the connection is
+ * opened.
+ */
+int lh_client_set_unmap_coalescing(struct lh_client_conn *conn, int window_us,
+                size_t max_bytes);
+
+/*
+ * Keep the connection's threads on the given CPUs, or on the CPUs of
+ * numa_node when nr_cpus is 0, and have them allocate their buffers from
+ * numa_node (-1 for no preference). Takes effect for threads started
+ * afterwards, so call it before opening the connection.
+ */
+int lh_client_set_affinity(struct lh_client_conn *conn, const int *cpus,
+                int nr_cpus, int numa_node);
+
+/*
+ * Requests issued by the calling thread use class prio, LH_CLIENT_PRIO_NORMAL
+ * by default. Background jobs such as rebuild or backup should switch their
+ * threads to LH_CLIENT_PRIO_BULK.
+ */
+int lh_client_set_thread_priority(int prio);
+/*
+ * Cap the requests of class prio in flight on conn (0 for no limit) and set
+ * its round-robin quantum. A quantum of 0 keeps the current one.
+ */
+int lh_client_set_class_limit(struct lh_client_conn *conn, int prio,
+                int max_inflight, int quantum_bytes);
+
+int lh_client_set_queue_depth(struct lh_client_conn *conn,
+                const struct lh_client_queue_depth *qd);
+
+/*
+ * Rate limit a connection, or a named group of connections sharing one set
+ * of buckets. Requests over the limit wait in submission order, they are
+ * never rejected. lh_client_qos_group_set() creates or updates a group,
+ * lh_client_join_qos_group() with a NULL name leaves the current group.
+ */
+int lh_client_set_qos(struct lh_client_conn *conn, const struct lh_client_qos *qos);
+int lh_client_qos_group_set(const char *name, const struct lh_client_qos *qos);
+int lh_client_qos_group_destroy(const char *name);
+int lh_client_join_qos_group(struct lh_client_conn *conn, const char *name);
+
+/*
+ * Scatter/gather variants: payload goes straight between the socket and
+ * the iovecs without a bounce buffer.
+ */
+int lh_client_readv_at(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset);
+int lh_client_writev_at(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset);
+
+/*
+ * A replica set sends each write once from the caller's buffer to every
+ * healthy member and returns when write_quorum of them acknowledged it.
+ * A member that fails a request, or acknowledges a write more than
+ * slow_ms after it was sent, is degraded and gets no further I/O until
+ * lh_client_replica_set_restore() is called once it has been rebuilt.
+ * Members are opened and closed by the caller and must outlive the set.
+ */
+#define LH_CLIENT_MAX_REPLICAS 16
+
+struct lh_client_replica_set;
+
+struct lh_client_replica_set *lh_client_replica_set_create(int write_quorum);
+void lh_client_replica_set_destroy(struct lh_client_replica_set *set);
+int lh_client_replica_set_add(struct lh_client_replica_set *set,
+                struct lh_client_conn *conn);
+int lh_client_replica_set_set_slow_threshold(struct lh_client_replica_set *set,
+                int slow_ms);
+/*
+ * Reads go to the healthy member with the lowest recent latency. With
+ * hedging enabled, a read that hasn't completed within the given latency
+ * percentile of its member (e.g. 95) is also sent to the next best one,
+ * and whichever answers first wins. 0 disables hedging.
+ */
+int lh_client_replica_set_set_read_hedging(struct lh_client_replica_set *set,
+                int percentile);
+int lh_client_replica_set_is_healthy(struct lh_client_replica_set *set, int idx);
+int lh_client_replica_set_restore(struct lh_client_replica_set *set, int idx);
+
+int lh_client_replica_set_read_at(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset);
+int lh_client_replica_set_write_at(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset);
+int lh_client_replica_set_unmap(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset);
+int lh_client_replica_set_readv_at(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset);
+int lh_client_replica_set_writev_at(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset);
+
+/*
+ * IO buffers from a per-connection pool of 2MiB huge page chunks, aligned
+ * to at least 4KiB and faulted in up front, so large transfers don't pay
+ * for TLB misses or page faults. lh_client_set_buffer_pool() optionally
+ * caps the memory the pool maps and, with LH_CLIENT_BUFFER_MLOCK, locks
+ * it. Buffers must be freed before the connection.
+ */
+#define LH_CLIENT_BUFFER_MLOCK 0x1
+
+int lh_client_set_buffer_pool(struct lh_client_conn *conn, size_t limit_bytes,
+                int flags);
+void *lh_client_alloc_buffer(struct lh_client_conn *conn, size_t size);
+void lh_client_free_buffer(struct lh_client_conn *conn, void *buf);
+
+/*
+ * Asynchronous variants. They return once the request is on the socket
+ * and callback(rc, arg) is called when it completes, usually from the
+ * response thread, but from the submitting thread if sending failed.
+ * Only the buffers have to stay valid until then, not the iovec array.
+ * A negative return value means nothing was submitted and callback won't
+ * be called.
+ *
+ * Callbacks must not block, nothing completes while they run. Submitting
+ * blocks while the request's class is at its lh_client_set_class_limit()
+ * cap, while a blocking lh_client_set_queue_depth() limit is reached,
+ * while a QoS limit of the connection or its group delays it. A callback
+ * that submits while any of these is configured can stall the connection
+ * until its requests time out, so it should hand the submission to
+ * another thread. Barriers are not waited for from a callback: a request
+ * that would have to wait on one completes with -EDEADLK instead.
+ */
+typedef void (*lh_client_callback_fn)(int rc, void *arg);
+
+int lh_client_readv_async(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, lh_client_callback_fn callback, void *arg);
+int lh_client_writev_async(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, lh_client_callback_fn callback, void *arg);
+int lh_client_unmap_async(struct lh_client_conn *conn, size_t count, off_t offset,
+                lh_client_callback_fn callback, void *arg);
+
+/*
+ * Per-request flags. A barrier is sent once every earlier request has
+ * completed, and later requests wait until it has completed, so the
+ * submitting thread blocks meanwhile. From a callback, where waiting
+ * would deadlock, a barrier or a request behind one completes with
+ * -EDEADLK instead; with unmap coalescing on, submitting a barrier from a
+ * callback fails with -EDEADLK right away. Barriers work with any replica
+ * and are never split into segments. FUA writes are stable on the
+ * replica once they complete and need LH_CLIENT_FEATURE_REQUEST_FLAGS,
+ * -EOPNOTSUPP otherwise. With that feature both flags are also passed on
+ * to the replica. If a reconnect lands on a replica without it, FUA
+ * writes not answered yet complete with -EOPNOTSUPP.
+ */
+#define LH_CLIENT_REQ_BARRIER   0x1
+#define LH_CLIENT_REQ_FUA       0x2
+
+int lh_client_readv_async_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t flags,
+                lh_client_callback_fn callback, void *arg);
+int lh_client_writev_async_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t flags,
+                lh_client_callback_fn callback, void *arg);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -0,0 +1,351 @@
+#ifndef LIBLONGHORN_HPP_HEADER
+#define LIBLONGHORN_HPP_HEADER
+
+/*
+ * Header-only C++20 layer over liblonghorn.h.
+ *
+ * Connection owns an lh_client_conn for its whole life. Besides blocking
+ * calls it offers read/write/unmap as futures and as awaitables; both
+ * are completed from the library's response thread, so no thread is
+ * parked per request. That thread must never block, and submitting can
+ * block (class limits, queue depth, QoS, barriers), so a coroutine
+ * awaiting an operation is resumed on the connection's resume thread
+ * instead. Coroutines of one connection take turns on it and should hand
+ * heavy work elsewhere.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "liblonghorn.h"
+
+namespace longhorn {
+
+using Buffer = std::span<std::byte>;
+using ConstBuffer = std::span<const std::byte>;
+
+inline void check(int rc, const char *what) {
+        if (rc < 0) {
+                throw std::system_error(-rc, std::generic_category(), what);
+        }
+}
+
+inline struct iovec to_iovec(ConstBuffer buf) {
+        return { const_cast<std::byte *>(buf.data()), buf.size() };
+}
+
+namespace detail {
+
+enum class Op { Read, Write, Unmap };
+
+inline int submit(struct lh_client_conn *conn, Op op, std::span<const struct iovec> iov,
+                size_t count, off_t offset, lh_client_callback_fn callback, void *arg) {
+        switch (op) {
+        case Op::Read:
+                return lh_client_readv_async(conn, iov.data(), (int)iov.size(),
+                                offset, callback, arg);
+        case Op::Write:
+                return lh_client_writev_async(conn, iov.data(), (int)iov.size(),
+                                offset, callback, arg);
+        case Op::Unmap:
+                return lh_client_unmap_async(conn, count, offset, callback, arg);
+        }
+        return -EINVAL;
+}
+
+// Owned by the library until the callback ran
+struct FutureState {
+        std::promise<void> promise;
+
+        static void complete(int rc, void *arg) {
+                auto *state = static_cast<FutureState *>(arg);
+
+                if (rc < 0) {
+                        state->promise.set_exception(std::make_exception_ptr(
+                                std::system_error(-rc, std::generic_category(),
+                                        "longhorn request")));
+                } else {
+                        state->promise.set_value();
+                }
+                delete state;
+        }
+};
+
+/*
+ * Runs resumed coroutines in order on its own thread. Destruction resumes
+ * whatever is still queued before the thread exits.
+ */
+class Resumer {
+public:
+        Resumer() : thread_([this] { run(); }) {}
+
+        ~Resumer() {
+                {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        stop_ = true;
+                }
+                cond_.notify_one();
+                thread_.join();
+        }
+
+        Resumer(const Resumer &) = delete;
+        Resumer &operator=(const Resumer &) = delete;
+
+        void post(std::coroutine_handle<> handle) {
+                {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        queue_.push_back(handle);
+                }
+                cond_.notify_one();
+        }
+
+private:
+        void run() {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                while (true) {
+                        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                        if (queue_.empty()) {
+                                return;
+                        }
+                        auto handle = queue_.front();
+                        queue_.pop_front();
+                        lock.unlock();
+                        handle.resume();
+                        lock.lock();
+                }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<std::coroutine_handle<>> queue_;
+        bool stop_ = false;
+        std::thread thread_; // last, starts once the rest is built
+};
+
+inline std::future<void> submit_future(struct lh_client_conn *conn, Op op,
+                std::span<const struct iovec> iov, size_t count, off_t offset) {
+        auto *state = new FutureState;
+        auto future = state->promise.get_future();
+        int rc = submit(conn, op, iov, count, offset, FutureState::complete, state);
+
+        if (rc < 0) {
+                delete state;
+                check(rc, "longhorn submit");
+        }
+        return future;
+}
+
+} // namespace detail
+
+/*
+ * co_await yields once the request completed and throws std::system_error
+ * if it failed. The completion may race with suspension, whichever side
+ * comes second resumes the coroutine: inline if the request completed
+ * before it suspended, on the resume thread otherwise. Buffers and iovecs
+ * must stay valid until the co_await returns.
+ */
+class Operation {
+public:
+        Operation(struct lh_client_conn *conn, detail::Resumer *resumer,
+                        detail::Op op, struct iovec iov, size_t count, off_t offset)
+                : conn_(conn), resumer_(resumer), op_(op), one_(iov), iov_(&one_, 1),
+                  count_(count), offset_(offset) {}
+
+        Operation(struct lh_client_conn *conn, detail::Resumer *resumer,
+                        detail::Op op, std::vector<struct iovec> iov, off_t offset)
+                : conn_(conn), resumer_(resumer), op_(op), vec_(std::move(iov)),
+                  iov_(vec_), count_(0), offset_(offset) {}
+
+        Operation(const Operation &) = delete;
+        Operation &operator=(const Operation &) = delete;
+
+        bool await_ready() const noexcept {
+                return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+                int rc;
+
+                handle_ = handle;
+                rc = detail::submit(conn_, op_, iov_, count_, offset_,
+                                &Operation::complete, this);
+                if (rc < 0) {
+                        rc_ = rc;
+                        return false;
+                }
+                // Already completed if the callback got here first
+                return state_.exchange(Suspended, std::memory_order_acq_rel) != Done;
+        }
+
+        void await_resume() const {
+                check(rc_, "longhorn request");
+        }
+
+private:
+        enum { Pending, Suspended, Done };
+
+        static void complete(int rc, void *arg) {
+                auto *op = static_cast<Operation *>(arg);
+
+                op->rc_ = rc;
+                if (op->state_.exchange(Done, std::memory_order_acq_rel) == Suspended) {
+                        // Never on the response thread
+                        op->resumer_->post(op->handle_);
+                }
+        }
+
+        struct lh_client_conn *conn_;
+        detail::Resumer *resumer_;
+        detail::Op op_;
+        struct iovec one_ = {};
+        std::vector<struct iovec> vec_;
+        std::span<const struct iovec> iov_;
+        size_t count_;
+        off_t offset_;
+        int rc_ = 0;
+        std::atomic<int> state_{Pending};
+        std::coroutine_handle<> handle_;
+};
+
+class Connection {
+public:
+        explicit Connection(const std::string &socket_path, int request_timeout = 15) {
+                conn_ = lh_client_allocate_conn(request_timeout);
+                if (conn_ == nullptr) {
+                        throw std::system_error(ENOMEM, std::generic_category(),
+                                        "longhorn allocate");
+                }
+                int rc = lh_client_open_conn(conn_, const_cast<char *>(socket_path.c_str()));
+                if (rc < 0) {
+                        lh_client_free_conn(conn_);
+                        check(rc, "longhorn open");
+                }
+                resumer_ = std::make_unique<detail::Resumer>();
+        }
+
+        ~Connection() {
+                reset();
+        }
+
+        Connection(Connection &&other) noexcept
+                : conn_(std::exchange(other.conn_, nullptr)),
+                  resumer_(std::move(other.resumer_)) {}
+
+        Connection &operator=(Connection &&other) noexcept {
+                if (this != &other) {
+                        reset();
+                        conn_ = std::exchange(other.conn_, nullptr);
+                        resumer_ = std::move(other.resumer_);
+                }
+                return *this;
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        // For the tuning calls that have no wrapper
+        struct lh_client_conn *native() const noexcept {
+                return conn_;
+        }
+
+        void read(Buffer buf, off_t offset) {
+                check(lh_client_read_at(conn_, buf.data(), buf.size(), offset),
+                                "longhorn read");
+        }
+
+        void write(ConstBuffer buf, off_t offset) {
+                check(lh_client_write_at(conn_, const_cast<std::byte *>(buf.data()),
+                                        buf.size(), offset), "longhorn write");
+        }
+
+        void unmap(size_t count, off_t offset) {
+                check(lh_client_unmap(conn_, nullptr, count, offset), "longhorn unmap");
+        }
+
+        std::future<void> read_future(Buffer buf, off_t offset) {
+                struct iovec iov = to_iovec(buf);
+                return detail::submit_future(conn_, detail::Op::Read, { &iov, 1 },
+                                buf.size(), offset);
+        }
+
+        std::future<void> write_future(ConstBuffer buf, off_t offset) {
+                struct iovec iov = to_iovec(buf);
+                return detail::submit_future(conn_, detail::Op::Write, { &iov, 1 },
+                                buf.size(), offset);
+        }
+
+        std::future<void> unmap_future(size_t count, off_t offset) {
+                return detail::submit_future(conn_, detail::Op::Unmap, {}, count, offset);
+        }
+
+        Operation read_async(Buffer buf, off_t offset) {
+                return Operation(conn_, resumer_.get(), detail::Op::Read, to_iovec(buf),
+                                buf.size(), offset);
+        }
+
+        Operation write_async(ConstBuffer buf, off_t offset) {
+                return Operation(conn_, resumer_.get(), detail::Op::Write, to_iovec(buf),
+                                buf.size(), offset);
+        }
+
+        Operation readv_async(std::span<const Buffer> bufs, off_t offset) {
+                return Operation(conn_, resumer_.get(), detail::Op::Read, iovecs(bufs),
+                                offset);
+        }
+
+        Operation writev_async(std::span<const ConstBuffer> bufs, off_t offset) {
+                return Operation(conn_, resumer_.get(), detail::Op::Write, iovecs(bufs),
+                                offset);
+        }
+
+        Operation unmap_async(size_t count, off_t offset) {
+                return Operation(conn_, resumer_.get(), detail::Op::Unmap, iovec{},
+                                count, offset);
+        }
+
+private:
+        template <typename B>
+        static std::vector<struct iovec> iovecs(std::span<const B> bufs) {
+                std::vector<struct iovec> iov;
+
+                iov.reserve(bufs.size());
+                for (const auto &buf : bufs) {
+                        iov.push_back(to_iovec(buf));
+                }
+                return iov;
+        }
+
+        // Closing fails what is outstanding, then the resume thread runs
+        // the coroutines that were waiting on it
+        void reset() noexcept {
+                if (conn_ != nullptr) {
+                        lh_client_close_conn(conn_);
+                        resumer_.reset();
+                        lh_client_free_conn(conn_);
+                        conn_ = nullptr;
+                }
+        }
+
+        struct lh_client_conn *conn_ = nullptr;
+        std::unique_ptr<detail::Resumer> resumer_;
+};
+
+} // namespace longhorn
+
+#endif
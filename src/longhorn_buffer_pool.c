@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "log.h"
+#include "liblonghorn.h"
+#include "longhorn_buffer_pool.h"
+
+void buffer_pool_init(struct BufferPool *pool) {
+        memset(pool, 0, sizeof(*pool));
+        pthread_mutex_init(&pool->mutex, NULL);
+        pool->numa_node = -1;
+}
+
+static int size_class(size_t size) {
+        int class = 0;
+
+        while (class < BUFFER_NR_CLASSES &&
+                        ((size_t)1 << (BUFFER_MIN_SHIFT + class)) < size) {
+                class++;
+        }
+        return class < BUFFER_NR_CLASSES ? class : -1;
+}
+
+static void bind_node(void *addr, size_t len, int node) {
+        unsigned long mask[4] = { 0 };
+
+        mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+        if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+                                sizeof(mask) * 8, 0) < 0) {
+                LOG_ERROR("Fail to bind buffer memory to node %d", node);
+        }
+}
+
+/*
+ * Explicit huge pages first. Without a hugetlbfs reservation fall back to
+ * an aligned mapping that transparent huge pages can back. The memory is
+ * faulted in up front so the IO path never takes a page fault.
+ */
+static void *map_chunk(struct BufferPool *pool, size_t size) {
+        void *raw, *base;
+        size_t off;
+
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+                raw = mmap(NULL, size + BUFFER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (raw == MAP_FAILED) {
+                        return NULL;
+                }
+                off = (BUFFER_CHUNK_SIZE - ((uintptr_t)raw & (BUFFER_CHUNK_SIZE - 1))) &
+                        (BUFFER_CHUNK_SIZE - 1);
+                base = (char *)raw + off;
+                if (off != 0) {
+                        munmap(raw, off);
+                }
+                munmap((char *)base + size, BUFFER_CHUNK_SIZE - off);
+                madvise(base, size, MADV_HUGEPAGE);
+        }
+
+        if (pool->numa_node >= 0) {
+                bind_node(base, size, pool->numa_node);
+        }
+        memset(base, 0, size);
+
+        if ((pool->flags & LH_CLIENT_BUFFER_MLOCK) && mlock(base, size) < 0) {
+                LOG_ERROR("Fail to lock %zu bytes of buffer memory", size);
+                munmap(base, size);
+                return NULL;
+        }
+        return base;
+}
+
+// Must be called with pool->mutex held
+static struct BufferChunk *add_chunk(struct BufferPool *pool, size_t size,
+                int class) {
+        struct BufferChunk *chunk;
+
+        if (pool->limit != 0 && pool->mapped + size > pool->limit) {
+                LOG_ERROR("Buffer pool limit of %zu bytes reached", pool->limit);
+                return NULL;
+        }
+
+        chunk = malloc(sizeof(*chunk));
+        if (chunk == NULL) {
+                return NULL;
+        }
+        chunk->base = map_chunk(pool, size);
+        if (chunk->base == NULL) {
+                LOG_ERROR("cannot map %zu bytes for buffer pool", size);
+                free(chunk);
+                return NULL;
+        }
+        chunk->size = size;
+        chunk->class = class;
+        HASH_ADD_PTR(pool->chunks, base, chunk);
+        pool->mapped += size;
+        return chunk;
+}
+
+void *buffer_pool_alloc(struct BufferPool *pool, size_t size) {
+        struct BufferChunk *chunk;
+        size_t block, off;
+        void *buf;
+        int class = size_class(size);
+
+        if (size == 0) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        if (class < 0) {
+                size = (size + BUFFER_CHUNK_SIZE - 1) & ~(BUFFER_CHUNK_SIZE - 1);
+                chunk = add_chunk(pool, size, -1);
+                pthread_mutex_unlock(&pool->mutex);
+                return chunk != NULL ? chunk->base : NULL;
+        }
+
+        if (pool->free_list[class] == NULL) {
+                chunk = add_chunk(pool, BUFFER_CHUNK_SIZE, class);
+                if (chunk == NULL) {
+                        pthread_mutex_unlock(&pool->mutex);
+                        return NULL;
+                }
+                // Push in reverse so buffers go out in address order
+                block = (size_t)1 << (BUFFER_MIN_SHIFT + class);
+                for (off = BUFFER_CHUNK_SIZE; off > 0; off -= block) {
+                        buf = (char *)chunk->base + off - block;
+                        *(void **)buf = pool->free_list[class];
+                        pool->free_list[class] = buf;
+                }
+        }
+        buf = pool->free_list[class];
+        pool->free_list[class] = *(void **)buf;
+        pthread_mutex_unlock(&pool->mutex);
+        return buf;
+}
+
+void buffer_pool_free(struct BufferPool *pool, void *buf) {
+        struct BufferChunk *chunk;
+        void *base = (void *)((uintptr_t)buf & ~(BUFFER_CHUNK_SIZE - 1));
+
+        if (buf == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        HASH_FIND_PTR(pool->chunks, &base, chunk);
+        if (chunk == NULL) {
+                pthread_mutex_unlock(&pool->mutex);
+                LOG_ERROR("BUG: %p was not allocated from this buffer pool", buf);
+                return;
+        }
+        if (chunk->class < 0) {
+                HASH_DEL(pool->chunks, chunk);
+                pool->mapped -= chunk->size;
+                pthread_mutex_unlock(&pool->mutex);
+                munmap(chunk->base, chunk->size);
+                free(chunk);
+                return;
+        }
+        // Small buffers stay with the pool, they get reused right away
+        *(void **)buf = pool->free_list[chunk->class];
+        pool->free_list[chunk->class] = buf;
+        pthread_mutex_unlock(&pool->mutex);
+}
+
+void buffer_pool_destroy(struct BufferPool *pool) {
+        struct BufferChunk *chunk, *tmp;
+
+        HASH_ITER(hh, pool->chunks, chunk, tmp) {
+                HASH_DEL(pool->chunks, chunk);
+                munmap(chunk->base, chunk->size);
+                free(chunk);
+        }
+        pthread_mutex_destroy(&pool->mutex);
+}
@@ -0,0 +1,41 @@
+#ifndef LONGHORN_BUFFER_POOL_HEADER
+#define LONGHORN_BUFFER_POOL_HEADER
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "uthash.h"
+
+#define BUFFER_CHUNK_SIZE  (2UL << 20)
+#define BUFFER_MIN_SHIFT   12
+// 4KiB up to a whole chunk
+#define BUFFER_NR_CLASSES  10
+
+/*
+ * A 2MiB aligned mapping, huge page backed if the system lets us. Chunks
+ * up to BUFFER_CHUNK_SIZE are carved into buffers of one size class,
+ * bigger requests get a chunk of their own.
+ */
+struct BufferChunk {
+        void            *base;
+        size_t          size;
+        int             class;    // -1 for a dedicated chunk
+        UT_hash_handle  hh;
+};
+
+struct BufferPool {
+        pthread_mutex_t mutex;
+        size_t          limit;    // bytes mapped at most, 0 unlimited
+        size_t          mapped;
+        int             flags;
+        int             numa_node;
+        struct BufferChunk *chunks;
+        void            *free_list[BUFFER_NR_CLASSES];
+};
+
+void buffer_pool_init(struct BufferPool *pool);
+void buffer_pool_destroy(struct BufferPool *pool);
+void *buffer_pool_alloc(struct BufferPool *pool, size_t size);
+void buffer_pool_free(struct BufferPool *pool, void *buf);
+
+#endif
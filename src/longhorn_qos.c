@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "longhorn_qos.h"
+
+static struct QosGroup *qos_groups;
+static pthread_mutex_t qos_groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t units_to_ns(uint64_t units, uint64_t rate) {
+        return (uint64_t)((unsigned __int128)units * 1000000000ULL / rate);
+}
+
+static void bucket_set(struct TokenBucket *bucket, uint64_t rate, uint64_t burst) {
+        __atomic_store_n(&bucket->burst, burst, __ATOMIC_RELAXED);
+        __atomic_store_n(&bucket->rate, rate, __ATOMIC_RELEASE);
+}
+
+/*
+ * Charge units to the bucket and return how long the caller has to wait
+ * before it conforms. Reservations are taken in CAS order, so throttled
+ * submitters are released in the order they arrived.
+ */
+static uint64_t bucket_reserve(struct TokenBucket *bucket, uint64_t units,
+                uint64_t now) {
+        uint64_t rate = __atomic_load_n(&bucket->rate, __ATOMIC_ACQUIRE);
+        uint64_t old, base, tolerance;
+
+        if (rate == 0 || units == 0) {
+                return 0;
+        }
+        tolerance = units_to_ns(__atomic_load_n(&bucket->burst, __ATOMIC_RELAXED),
+                        rate);
+
+        old = __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED);
+        do {
+                base = old > now ? old : now;
+        } while (!__atomic_compare_exchange_n(&bucket->tat, &old,
+                                base + units_to_ns(units, rate), 1,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        return base > now + tolerance ? base - now - tolerance : 0;
+}
+
+void qos_limiter_set(struct QosLimiter *limiter, const struct lh_client_qos *qos) {
+        bucket_set(&limiter->iops, qos->iops, qos->iops_burst);
+        bucket_set(&limiter->bandwidth, qos->bps, qos->bps_burst);
+}
+
+uint64_t qos_limiter_reserve(struct QosLimiter *limiter, uint64_t bytes,
+                uint64_t now) {
+        uint64_t delay, bw_delay;
+
+        delay = bucket_reserve(&limiter->iops, 1, now);
+        bw_delay = bucket_reserve(&limiter->bandwidth, bytes, now);
+        return delay > bw_delay ? delay : bw_delay;
+}
+
+static struct QosGroup *find_group(const char *name) {
+        struct QosGroup *group;
+
+        DL_FOREACH(qos_groups, group) {
+                if (strcmp(group->name, name) == 0) {
+                        return group;
+                }
+        }
+        return NULL;
+}
+
+// Take a reference on an existing group
+struct QosGroup *qos_group_get(const char *name) {
+        struct QosGroup *group;
+
+        pthread_mutex_lock(&qos_groups_mutex);
+        group = find_group(name);
+        if (group != NULL) {
+                group->refcount++;
+        }
+        pthread_mutex_unlock(&qos_groups_mutex);
+        return group;
+}
+
+void qos_group_put(struct QosGroup *group) {
+        pthread_mutex_lock(&qos_groups_mutex);
+        group->refcount--;
+        pthread_mutex_unlock(&qos_groups_mutex);
+}
+
+int lh_client_qos_group_set(const char *name, const struct lh_client_qos *qos) {
+        struct QosGroup *group;
+
+        if (name == NULL || qos == NULL || strlen(name) >= sizeof(group->name)) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&qos_groups_mutex);
+        group = find_group(name);
+        if (group == NULL) {
+                group = calloc(1, sizeof(*group));
+                if (group == NULL) {
+                        pthread_mutex_unlock(&qos_groups_mutex);
+                        LOG_ERROR("cannot allocate memory for qos group %s", name);
+                        return -ENOMEM;
+                }
+                strcpy(group->name, name);
+                DL_APPEND(qos_groups, group);
+        }
+        qos_limiter_set(&group->limiter, qos);
+        pthread_mutex_unlock(&qos_groups_mutex);
+        return 0;
+}
+
+int lh_client_qos_group_destroy(const char *name) {
+        struct QosGroup *group;
+        int rc = 0;
+
+        if (name == NULL) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&qos_groups_mutex);
+        group = find_group(name);
+        if (group == NULL) {
+                rc = -ENOENT;
+        } else if (group->refcount > 0) {
+                rc = -EBUSY;
+        } else {
+                DL_DELETE(qos_groups, group);
+                free(group);
+        }
+        pthread_mutex_unlock(&qos_groups_mutex);
+        return rc;
+}
@@ -0,0 +1,40 @@
+#ifndef LONGHORN_QOS_HEADER
+#define LONGHORN_QOS_HEADER
+
+#include <stdint.h>
+
+#include "liblonghorn.h"
+#include "utlist.h"
+
+/*
+ * Token bucket kept in GCRA form: instead of a token count the bucket
+ * stores the time it would be empty again, so a submission is one
+ * compare-and-swap and concurrent submitters never take a lock.
+ */
+struct TokenBucket {
+        uint64_t        tat;            // theoretical arrival time, ns
+        uint64_t        rate;           // units per second, 0 unlimited
+        uint64_t        burst;          // units that may go without waiting
+};
+
+struct QosLimiter {
+        struct TokenBucket iops;
+        struct TokenBucket bandwidth;
+};
+
+struct QosGroup {
+        char            name[64];
+        int             refcount;
+        struct QosLimiter limiter;
+
+        struct QosGroup *next, *prev;
+};
+
+void qos_limiter_set(struct QosLimiter *limiter, const struct lh_client_qos *qos);
+uint64_t qos_limiter_reserve(struct QosLimiter *limiter, uint64_t bytes,
+                uint64_t now);
+
+struct QosGroup *qos_group_get(const char *name);
+void qos_group_put(struct QosGroup *group);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * Lock Sequence:
+ * write->mutex
+ * conn->msg_mutex
+ *
+ * set->mutex is a leaf lock.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "longhorn_replica_set.h"
+
+#define READ_PROBE_INTERVAL 32
+#define READ_HEDGE_MIN_SAMPLES 32
+
+static void replica_degrade(struct lh_client_replica_set *set, int idx,
+                const char *reason) {
+        pthread_mutex_lock(&set->mutex);
+        if (set->members[idx].healthy) {
+                set->members[idx].healthy = 0;
+                LOG_ERROR("Degrade replica %s: %s",
+                                set->members[idx].conn->socket_path, reason);
+        }
+        pthread_mutex_unlock(&set->mutex);
+}
+
+static void replica_write_put(struct ReplicaWrite *w) {
+        struct lh_client_replica_set *set = w->set;
+
+        if (__sync_sub_and_fetch(&w->refs, 1) != 0) {
+                return;
+        }
+
+        pthread_mutex_destroy(&w->mutex);
+        free(w);
+
+        pthread_mutex_lock(&set->mutex);
+        if (--set->inflight == 0) {
+                pthread_cond_broadcast(&set->cond);
+        }
+        pthread_mutex_unlock(&set->mutex);
+}
+
+static void replica_write_done(struct Completion *comp, void *arg) {
+        struct ReplicaChild *child = arg;
+        struct ReplicaWrite *w = child->write;
+        struct lh_client_replica_set *set = w->set;
+        struct Request *r;
+        uint64_t elapsed = monotonic_ns() - w->start_ns;
+        int rc = comp->rc;
+
+        if (rc < 0) {
+                replica_degrade(set, child->member, "request failed");
+        } else if (set->slow_ns != 0 && elapsed > set->slow_ns) {
+                replica_degrade(set, child->member, "too slow");
+        }
+
+        pthread_mutex_lock(&w->mutex);
+        r = child->req;
+        child->req = NULL;
+        pthread_mutex_unlock(&w->mutex);
+        request_free(r);
+
+        completion_done(&w->comp, rc);
+        replica_write_put(w);
+}
+
+/*
+ * Members get the request one after the other from the caller's thread,
+ * each send only hands the buffer to the socket, so the replicas work on
+ * it in parallel.
+ */
+static int replica_set_write(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset, uint32_t type) {
+        struct ReplicaWrite *w;
+        struct ReplicaChild *child;
+        struct Request *stragglers[LH_CLIENT_MAX_REPLICAS];
+        int targets[LH_CLIENT_MAX_REPLICAS];
+        int i, n = 0, nr_stragglers = 0, rc;
+
+        w = calloc(1, sizeof(*w));
+        if (w == NULL) {
+                LOG_ERROR("cannot allocate memory for replicated request");
+                return -ENOMEM;
+        }
+
+        pthread_mutex_lock(&set->mutex);
+        for (i = 0; i < set->nr_members; i++) {
+                if (set->members[i].healthy) {
+                        targets[n++] = i;
+                }
+        }
+        if (n < set->write_quorum) {
+                pthread_mutex_unlock(&set->mutex);
+                LOG_ERROR("Only %d healthy replicas, write quorum is %d",
+                                n, set->write_quorum);
+                free(w);
+                return -EIO;
+        }
+        set->inflight++;
+        pthread_mutex_unlock(&set->mutex);
+
+        pthread_mutex_init(&w->mutex, NULL);
+        w->set = set;
+        w->refs = n + 1;
+        w->start_ns = monotonic_ns();
+        completion_init(&w->comp, n, set->write_quorum);
+
+        for (i = 0; i < n; i++) {
+                child = &w->children[i];
+                child->write = w;
+                child->member = targets[i];
+                rc = request_start(set->members[targets[i]].conn, iov, iovcnt,
+                                offset, type, replica_write_done, child,
+                                &child->req);
+                if (rc < 0) {
+                        replica_degrade(set, targets[i], "cannot send");
+                        completion_done(&w->comp, rc);
+                        replica_write_put(w);
+                }
+        }
+
+        rc = wait_completion(&w->comp);
+
+        // Stragglers must not be replayed from our caller's buffer later
+        pthread_mutex_lock(&w->mutex);
+        for (i = 0; i < n; i++) {
+                if (w->children[i].req != NULL) {
+                        request_detach(w->children[i].req);
+                        stragglers[nr_stragglers++] = request_get(w->children[i].req);
+                }
+        }
+        pthread_mutex_unlock(&w->mutex);
+
+        // nor still be on their way out of it, in sender mode. Not under
+        // w->mutex, their completions take it.
+        for (i = 0; i < nr_stragglers; i++) {
+                request_wait_sent(stragglers[i]);
+                request_free(stragglers[i]);
+        }
+
+        replica_write_put(w);
+        return rc;
+}
+
+static int latency_bucket(uint64_t us) {
+        int msb, b;
+
+        if (us < 4) {
+                return us;
+        }
+        msb = 63 - __builtin_clzll(us);
+        b = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+        return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+static uint64_t latency_bucket_upper_us(int b) {
+        int shift;
+
+        if (b < 4) {
+                return b + 1;
+        }
+        shift = b / 4 - 1;
+        return (uint64_t)(4 + b % 4 + 1) << shift;
+}
+
+// Must be called with set->mutex held
+static void member_record_latency(struct ReplicaMember *m, uint64_t ns) {
+        int i;
+
+        m->ewma_ns = m->samples == 0 ? ns : m->ewma_ns - m->ewma_ns / 8 + ns / 8;
+
+        // Halve the history now and then so the percentile follows changes
+        if (++m->samples > 1024) {
+                m->samples = 0;
+                for (i = 0; i < LATENCY_BUCKETS; i++) {
+                        m->latency[i] /= 2;
+                        m->samples += m->latency[i];
+                }
+                m->samples++;
+        }
+        m->latency[latency_bucket(ns / 1000)]++;
+}
+
+// Must be called with set->mutex held, 0 if there's too little history
+static uint64_t member_percentile_ns(struct ReplicaMember *m, int percentile) {
+        uint64_t want, seen = 0;
+        int i;
+
+        if (m->samples < READ_HEDGE_MIN_SAMPLES) {
+                return 0;
+        }
+        want = ((uint64_t)m->samples * percentile + 99) / 100;
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+                seen += m->latency[i];
+                if (seen >= want) {
+                        break;
+                }
+        }
+        return latency_bucket_upper_us(i) * 1000;
+}
+
+/*
+ * Pick the healthy member with the lowest latency, other than exclude.
+ * Every READ_PROBE_INTERVAL reads go round-robin instead, so a member
+ * that was slow once gets the chance to show it recovered.
+ */
+static int replica_pick_reader(struct lh_client_replica_set *set, int exclude,
+                uint64_t *hedge_ns) {
+        struct ReplicaMember *m;
+        int probe, best = -1, i, k;
+
+        pthread_mutex_lock(&set->mutex);
+        probe = (++set->reads % READ_PROBE_INTERVAL) == 0;
+        for (k = 0; k < set->nr_members; k++) {
+                i = (set->next_read + k) % set->nr_members;
+                m = &set->members[i];
+                if (!m->healthy || i == exclude) {
+                        continue;
+                }
+                if (best < 0 || m->ewma_ns < set->members[best].ewma_ns) {
+                        best = i;
+                }
+                if (probe) {
+                        break;
+                }
+        }
+        if (best >= 0) {
+                set->next_read = (best + 1) % set->nr_members;
+                if (hedge_ns != NULL) {
+                        *hedge_ns = 0;
+                        if (set->hedge_percentile != 0) {
+                                *hedge_ns = member_percentile_ns(&set->members[best],
+                                                set->hedge_percentile);
+                        }
+                }
+        }
+        pthread_mutex_unlock(&set->mutex);
+        return best;
+}
+
+static void replica_read_done(struct Completion *comp, void *arg) {
+        struct ReplicaReadChild *child = arg;
+        struct ReplicaRead *rd = child->read;
+
+        child->rc = comp->rc;
+        child->end_ns = monotonic_ns();
+        if (comp->rc == 0) {
+                __sync_bool_compare_and_swap(&rd->winner, -1,
+                                (int)(child - rd->children));
+        }
+        completion_done(&rd->first, comp->rc);
+        completion_done(&rd->all, comp->rc);
+}
+
+static int replica_read_start(struct lh_client_replica_set *set,
+                struct ReplicaRead *rd, int member,
+                const struct iovec *iov, int iovcnt, off_t offset) {
+        struct ReplicaReadChild *child = &rd->children[rd->nr_children++];
+        int rc;
+
+        child->read = rd;
+        child->member = member;
+        child->rc = 0;
+        child->req = NULL;
+        child->start_ns = monotonic_ns();
+        rc = request_start(set->members[member].conn, iov, iovcnt, offset,
+                        TypeRead, replica_read_done, child, &child->req);
+        if (rc < 0) {
+                child->rc = rc;
+                child->end_ns = child->start_ns;
+                completion_done(&rd->first, rc);
+                completion_done(&rd->all, rc);
+        }
+        return rc;
+}
+
+/*
+ * One attempt, hedged if the first member is late. The hedge reads into
+ * a bounce buffer: the first member may still be filling the caller's
+ * buffer when the hedge answers, so it gets cancelled and drained first.
+ */
+static int replica_read_once(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset, size_t count) {
+        struct ReplicaRead rd;
+        struct ReplicaReadChild *child;
+        struct iovec bounce_iov;
+        void *bounce = NULL;
+        uint64_t hedge_ns;
+        int primary, second = -1, i, rc;
+        size_t done;
+
+        primary = replica_pick_reader(set, -1, &hedge_ns);
+        if (primary < 0) {
+                LOG_ERROR("No healthy replica to read from");
+                return -EIO;
+        }
+
+        rd.winner = -1;
+        rd.nr_children = 0;
+        // The second slot is the hedge, or completed empty if none goes out
+        completion_init(&rd.first, 2, 1);
+        completion_init(&rd.all, 2, 0);
+        replica_read_start(set, &rd, primary, iov, iovcnt, offset);
+
+        if (hedge_ns != 0 && wait_completion_until(&rd.first,
+                                monotonic_ns() + hedge_ns) == -ETIMEDOUT) {
+                second = replica_pick_reader(set, primary, NULL);
+                if (second >= 0) {
+                        bounce = lh_client_alloc_buffer(set->members[second].conn,
+                                        count);
+                }
+        }
+        if (bounce != NULL) {
+                bounce_iov.iov_base = bounce;
+                bounce_iov.iov_len = count;
+                replica_read_start(set, &rd, second, &bounce_iov, 1, offset);
+        } else {
+                completion_done(&rd.first, -ECANCELED);
+                completion_done(&rd.all, -ECANCELED);
+        }
+
+        wait_completion(&rd.first);
+        for (i = 0; i < rd.nr_children; i++) {
+                if (rd.children[i].req != NULL) {
+                        request_cancel(rd.children[i].req);
+                }
+        }
+        wait_completion(&rd.all);
+
+        if (rd.winner == 1) {
+                for (i = 0, done = 0; i < iovcnt; done += iov[i].iov_len, i++) {
+                        memcpy(iov[i].iov_base, (char *)bounce + done, iov[i].iov_len);
+                }
+        }
+
+        pthread_mutex_lock(&set->mutex);
+        for (i = 0; i < rd.nr_children; i++) {
+                child = &rd.children[i];
+                // A cancelled loser still tells us it took at least this long
+                if (child->rc == 0 || child->rc == -ECANCELED) {
+                        member_record_latency(&set->members[child->member],
+                                        child->end_ns - child->start_ns);
+                }
+        }
+        pthread_mutex_unlock(&set->mutex);
+
+        rc = -EIO;
+        for (i = 0; i < rd.nr_children; i++) {
+                child = &rd.children[i];
+                if (child->rc < 0 && child->rc != -ECANCELED) {
+                        replica_degrade(set, child->member, "read failed");
+                        rc = child->rc;
+                }
+                if (child->req != NULL) {
+                        request_free(child->req);
+                }
+        }
+        if (bounce != NULL) {
+                lh_client_free_buffer(set->members[second].conn, bounce);
+        }
+
+        return rd.winner >= 0 ? 0 : rc;
+}
+
+static int replica_set_read(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset) {
+        size_t count = 0;
+        int i, rc = -EIO;
+
+        for (i = 0; i < iovcnt; i++) {
+                count += iov[i].iov_len;
+        }
+
+        // Every failed attempt degrades a member, so this ends
+        for (i = 0; i < LH_CLIENT_MAX_REPLICAS; i++) {
+                rc = replica_read_once(set, iov, iovcnt, offset, count);
+                if (rc == 0 || rc == -EIO) {
+                        break;
+                }
+        }
+        return rc;
+}
+
+struct lh_client_replica_set *lh_client_replica_set_create(int write_quorum) {
+        struct lh_client_replica_set *set;
+
+        if (write_quorum < 1 || write_quorum > LH_CLIENT_MAX_REPLICAS) {
+                LOG_ERROR("Invalid write quorum %d", write_quorum);
+                return NULL;
+        }
+
+        set = calloc(1, sizeof(*set));
+        if (set == NULL) {
+                LOG_ERROR("cannot allocate memory for replica set");
+                return NULL;
+        }
+        pthread_mutex_init(&set->mutex, NULL);
+        pthread_cond_init(&set->cond, NULL);
+        set->write_quorum = write_quorum;
+        return set;
+}
+
+// Waits for writes that returned at quorum but are still on a slow member
+void lh_client_replica_set_destroy(struct lh_client_replica_set *set) {
+        pthread_mutex_lock(&set->mutex);
+        while (set->inflight > 0) {
+                pthread_cond_wait(&set->cond, &set->mutex);
+        }
+        pthread_mutex_unlock(&set->mutex);
+
+        pthread_cond_destroy(&set->cond);
+        pthread_mutex_destroy(&set->mutex);
+        free(set);
+}
+
+int lh_client_replica_set_add(struct lh_client_replica_set *set,
+                struct lh_client_conn *conn) {
+        int idx;
+
+        if (conn == NULL) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&set->mutex);
+        if (set->nr_members == LH_CLIENT_MAX_REPLICAS) {
+                pthread_mutex_unlock(&set->mutex);
+                return -ENOSPC;
+        }
+        idx = set->nr_members++;
+        set->members[idx].conn = conn;
+        set->members[idx].healthy = 1;
+        pthread_mutex_unlock(&set->mutex);
+        return idx;
+}
+
+int lh_client_replica_set_set_slow_threshold(struct lh_client_replica_set *set,
+                int slow_ms) {
+        if (slow_ms < 0) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&set->mutex);
+        set->slow_ns = (uint64_t)slow_ms * 1000000ULL;
+        pthread_mutex_unlock(&set->mutex);
+        return 0;
+}
+
+int lh_client_replica_set_set_read_hedging(struct lh_client_replica_set *set,
+                int percentile) {
+        if (percentile < 0 || percentile >= 100) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&set->mutex);
+        set->hedge_percentile = percentile;
+        pthread_mutex_unlock(&set->mutex);
+        return 0;
+}
+
+int lh_client_replica_set_is_healthy(struct lh_client_replica_set *set, int idx) {
+        int rc;
+
+        pthread_mutex_lock(&set->mutex);
+        if (idx < 0 || idx >= set->nr_members) {
+                rc = -EINVAL;
+        } else {
+                rc = set->members[idx].healthy;
+        }
+        pthread_mutex_unlock(&set->mutex);
+        return rc;
+}
+
+int lh_client_replica_set_restore(struct lh_client_replica_set *set, int idx) {
+        int rc = 0;
+
+        pthread_mutex_lock(&set->mutex);
+        if (idx < 0 || idx >= set->nr_members) {
+                rc = -EINVAL;
+        } else {
+                set->members[idx].healthy = 1;
+                // Latency from before the rebuild says nothing now
+                set->members[idx].ewma_ns = 0;
+                set->members[idx].samples = 0;
+                memset(set->members[idx].latency, 0,
+                                sizeof(set->members[idx].latency));
+        }
+        pthread_mutex_unlock(&set->mutex);
+        return rc;
+}
+
+int lh_client_replica_set_read_at(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return replica_set_read(set, &iov, 1, offset);
+}
+
+int lh_client_replica_set_write_at(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return replica_set_write(set, &iov, 1, offset, TypeWrite);
+}
+
+int lh_client_replica_set_unmap(struct lh_client_replica_set *set, void *buf,
+                size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return replica_set_write(set, &iov, 1, offset, TypeUnmap);
+}
+
+int lh_client_replica_set_readv_at(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset) {
+        return replica_set_read(set, iov, iovcnt, offset);
+}
+
+int lh_client_replica_set_writev_at(struct lh_client_replica_set *set,
+                const struct iovec *iov, int iovcnt, off_t offset) {
+        return replica_set_write(set, iov, iovcnt, offset, TypeWrite);
+}
@@ -0,0 +1,80 @@
+#ifndef LONGHORN_REPLICA_SET_HEADER
+#define LONGHORN_REPLICA_SET_HEADER
+
+#include <pthread.h>
+
+#include "longhorn_rpc_client.h"
+
+// Log-linear buckets: 4 per power of two of microseconds
+#define LATENCY_BUCKETS 128
+
+struct ReplicaMember {
+        struct lh_client_conn *conn;
+        int             healthy;
+
+        // Recent read latency, used to route reads and to pick hedge delays
+        uint64_t        ewma_ns;
+        uint32_t        latency[LATENCY_BUCKETS];
+        uint32_t        samples;
+};
+
+struct lh_client_replica_set {
+        pthread_mutex_t mutex;
+        pthread_cond_t  cond;
+        struct ReplicaMember members[LH_CLIENT_MAX_REPLICAS];
+        int             nr_members;
+        int             write_quorum;
+        uint64_t        slow_ns;  // 0 never degrades a member for latency
+        int             next_read;
+        unsigned int    reads;
+        int             hedge_percentile; // 0 disables hedged reads
+        int             inflight; // fan-outs still referencing the set
+};
+
+/*
+ * One fan-out. Each member request completes into comp; the caller waits
+ * for the quorum and the stragglers finish on their own, the last one
+ * out frees the fan-out.
+ */
+struct ReplicaWrite;
+
+struct ReplicaChild {
+        struct ReplicaWrite *write;
+        int             member;
+        struct Request  *req;     // NULL once completed
+};
+
+struct ReplicaWrite {
+        pthread_mutex_t mutex;
+        struct lh_client_replica_set *set;
+        struct Completion comp;
+        int             refs;
+        uint64_t        start_ns;
+        struct ReplicaChild children[LH_CLIENT_MAX_REPLICAS];
+};
+
+/*
+ * A read goes to one member and, if that is late, to a second one. Both
+ * are always finished or cancelled before the caller returns, so this
+ * lives on the caller's stack.
+ */
+struct ReplicaRead;
+
+struct ReplicaReadChild {
+        struct ReplicaRead *read;
+        int             member;
+        int             rc;
+        uint64_t        start_ns;
+        uint64_t        end_ns;
+        struct Request  *req;
+};
+
+struct ReplicaRead {
+        struct Completion first;  // decided by the first success
+        struct Completion all;
+        int             winner;
+        int             nr_children;
+        struct ReplicaReadChild children[2];
+};
+
+#endif
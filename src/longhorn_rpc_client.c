@@ -1,7 +1,7 @@
 /* 
  * Lock Sequence:
  * conn->msg_mutex
- * msg->mutex
+ * conn->sched.mutex
  * conn->mutex
  * */
 
@@ -12,9 +12,17 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <time.h>
+#include <endian.h>
 #include <poll.h>
+#include <sched.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "log.h"
 #include "longhorn_rpc_client.h"
@@ -22,475 +30,3014 @@
 int retry_interval = 5;
 int retry_counts = 5;
 
-int send_request(struct lh_client_conn *conn, struct Message *req) {
+#define DEFAULT_SEGMENT_SIZE (1024 * 1024)
+
+// Responses are read in bulk into a buffer of this size, and up to
+// RESPONSE_BATCH of them are decoded at a time
+#define RECV_BUFFER_SIZE (128 * 1024)
+#define RESPONSE_BATCH 32
+
+// Requests the sender thread writes per batch
+#define SENDER_BATCH 64
+
+// How long a replica gets to answer feature negotiation on connect
+#define FEATURES_TIMEOUT_MS 1000
+
+// Fixed scheduling cost per request, so requests without payload aren't free
+#define SCHED_REQUEST_COST 4096
+
+// Only reads and writes move data; for the other types Size is a range or
+// a query length
+static inline int type_has_payload(uint32_t type) {
+        return type == TypeRead || type == TypeWrite;
+}
+
+_Static_assert(LH_CLIENT_FEATURE_SPARSE_READ == FeatureSparseRead &&
+                LH_CLIENT_FEATURE_EXTENTS == FeatureExtents &&
+                LH_CLIENT_FEATURE_REQUEST_FLAGS == FeatureRequestFlags,
+                "public feature bits are the wire bits");
+_Static_assert(LH_CLIENT_EXTENT_HOLE == ExtentHole && LH_CLIENT_EXTENT_ZERO == ExtentZero,
+                "public extent flags are the wire flags");
+_Static_assert(LH_CLIENT_REQ_BARRIER == RequestBarrier && LH_CLIENT_REQ_FUA == RequestFUA,
+                "public request flags are the wire flags");
+
+static const int default_quantum[LH_CLIENT_PRIO_CLASSES] = {
+        [LH_CLIENT_PRIO_LATENCY] = 512 * 1024,
+        [LH_CLIENT_PRIO_NORMAL] = 256 * 1024,
+        [LH_CLIENT_PRIO_BULK] = 64 * 1024,
+};
+
+static __thread int thread_prio = LH_CLIENT_PRIO_NORMAL;
+
+uint64_t monotonic_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_socket(const char *socket_path) {
+        struct sockaddr_un addr;
+        int fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+                LOG_ERROR("socket error");
+                return -EFAULT;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, socket_path,
+                        strnlen(socket_path, sizeof(addr.sun_path) - 1));
+
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                close(fd);
+                return -errno;
+        }
+        return fd;
+}
+
+static int reconnect_enabled(struct lh_client_conn *conn) {
+        return conn->reconnect_backoff.max_attempts > 0;
+}
+
+static int validate_backoff(const struct lh_client_backoff *backoff) {
+        if (backoff == NULL || backoff->max_attempts < 0 ||
+                        backoff->initial_delay_ms < 0 ||
+                        backoff->max_delay_ms < backoff->initial_delay_ms ||
+                        backoff->multiplier < 1.0 ||
+                        backoff->jitter_pct < 0 || backoff->jitter_pct > 100) {
+                return -EINVAL;
+        }
+        return 0;
+}
+
+/*
+ * Dial the socket until it succeeds, the policy runs out of attempts or
+ * keep_going() says the caller lost interest. Returns the connected fd.
+ */
+static int dial_with_backoff(struct lh_client_conn *conn,
+                const struct lh_client_backoff *backoff,
+                int (*keep_going)(struct lh_client_conn *conn)) {
+        double delay_ms = backoff->initial_delay_ms;
+        long sleep_ms;
+        struct timespec ts;
+        int fd = -EFAULT, i;
+
+        for (i = 0; i < backoff->max_attempts; i++) {
+                fd = connect_socket(conn->socket_path);
+                if (fd >= 0) {
+                        break;
+                }
+                if (i == backoff->max_attempts - 1 ||
+                                (keep_going != NULL && !keep_going(conn))) {
+                        break;
+                }
+
+                LOG_ERROR("Cannot connect, retrying");
+                sleep_ms = (long)delay_ms;
+                if (backoff->jitter_pct > 0) {
+                        sleep_ms -= (long)(delay_ms * backoff->jitter_pct / 100 *
+                                        rand_r(&conn->backoff_seed) / RAND_MAX);
+                }
+                ts.tv_sec = sleep_ms / 1000;
+                ts.tv_nsec = (sleep_ms % 1000) * 1000000L;
+                nanosleep(&ts, NULL);
+
+                delay_ms *= backoff->multiplier;
+                if (delay_ms > backoff->max_delay_ms) {
+                        delay_ms = backoff->max_delay_ms;
+                }
+        }
+        return fd;
+}
+
+static int still_reconnecting(struct lh_client_conn *conn) {
+        int reconnecting;
+
+        pthread_mutex_lock(&conn->mutex);
+        reconnecting = (conn->state == CLIENT_CONN_STATE_RECONNECTING);
+        pthread_mutex_unlock(&conn->mutex);
+        return reconnecting;
+}
+
+/*
+ * Flags only go on the wire if the replica negotiated them, and that may
+ * have changed by a reconnect since req was built. Without the feature a
+ * barrier is still ordered here, but nothing can stand in for FUA.
+ *
+ * Must be called with conn->mutex held.
+ */
+static int request_fit_flags(struct lh_client_conn *conn, struct Message *req) {
+        if (req->Flags == 0 || (conn->features & FeatureRequestFlags)) {
+                return 0;
+        }
+        if (req->Flags & RequestFUA) {
+                return -EOPNOTSUPP;
+        }
+        req->Flags = 0;
+        return 0;
+}
+
+static int send_request(struct lh_client_conn *conn, struct Message *req,
+                uint32_t replays) {
         int rc = 0;
 
         pthread_mutex_lock(&conn->mutex);
+        if (conn->state == CLIENT_CONN_STATE_CLOSE) {
+                // The socket may be gone, never write to what the fd is now
+                pthread_mutex_unlock(&conn->mutex);
+                return -EFAULT;
+        }
+        if (conn->state == CLIENT_CONN_STATE_RECONNECTING) {
+                // Still queued, it will be replayed once the socket is back
+                pthread_mutex_unlock(&conn->mutex);
+                return 0;
+        }
+        if (conn->replays != replays) {
+                // A reconnect already replayed it, and req may even be
+                // answered and gone by now
+                pthread_mutex_unlock(&conn->mutex);
+                return 0;
+        }
+        rc = request_fit_flags(conn, req);
+        if (rc < 0) {
+                pthread_mutex_unlock(&conn->mutex);
+                return rc;
+        }
         rc = send_msg(conn->fd, req, conn->request_header, conn->header_size);
+        if (rc < 0 && reconnect_enabled(conn) &&
+                        conn->state == CLIENT_CONN_STATE_OPEN) {
+                // The stream may be torn mid-message. Make sure the response
+                // thread notices, it will reconnect and replay this request.
+                LOG_ERROR("Fail to send request %d, waiting for reconnection",
+                                req->Seq);
+                shutdown(conn->fd, SHUT_RDWR);
+                rc = 0;
+        }
         pthread_mutex_unlock(&conn->mutex);
         return rc;
 }
 
-int receive_response(struct lh_client_conn *conn, struct Message *resp) {
-        return receive_msg(conn->fd, resp, conn->response_header, conn->header_size);
+static void sched_init(struct Scheduler *sched) {
+        int i;
+
+        pthread_mutex_init(&sched->mutex, NULL);
+        pthread_cond_init(&sched->cond, NULL);
+        for (i = 0; i < LH_CLIENT_PRIO_CLASSES; i++) {
+                sched->quantum[i] = default_quantum[i];
+        }
+}
+
+static int sched_class_has_room(struct Scheduler *sched, int prio) {
+        if (sched->depth != 0 && sched->total_inflight >= sched->depth) {
+                return 0;
+        }
+        return sched->max_inflight[prio] == 0 ||
+                sched->inflight[prio] < sched->max_inflight[prio];
+}
+
+// Must be called with sched->mutex held
+static void sched_grant(struct Scheduler *sched, struct Message *req) {
+        req->sched_state = SCHED_STATE_INFLIGHT;
+        req->send_ns = monotonic_ns();
+        sched->inflight[req->prio]++;
+        sched->total_inflight++;
+        sched->busy = 1;
+        if (sched->waiters > 0) {
+                pthread_cond_broadcast(&sched->cond);
+        }
+}
+
+/*
+ * Hand the send turn to the next request by deficit round-robin. A class
+ * keeps the turn while its deficit covers the cost of its head request,
+ * otherwise it is credited one quantum and the pointer moves on. Classes
+ * at their in-flight limit are skipped without credit.
+ *
+ * Must be called with sched->mutex held and no turn handed out.
+ */
+static void sched_dispatch(struct Scheduler *sched) {
+        struct Message *req;
+        int i, prio, eligible;
+
+        do {
+                eligible = 0;
+                for (i = 0; i < LH_CLIENT_PRIO_CLASSES; i++) {
+                        prio = (sched->current + i) % LH_CLIENT_PRIO_CLASSES;
+                        req = sched->queue[prio];
+                        if (req == NULL) {
+                                sched->deficit[prio] = 0;
+                                continue;
+                        }
+                        if (!sched_class_has_room(sched, prio)) {
+                                continue;
+                        }
+                        eligible = 1;
+
+                        if (sched->deficit[prio] >= req->sched_cost) {
+                                sched->deficit[prio] -= req->sched_cost;
+                                DL_DELETE2(sched->queue[prio], req,
+                                                sched_prev, sched_next);
+                                sched->queued--;
+                                sched->current = prio;
+                                sched_grant(sched, req);
+                                return;
+                        }
+                        sched->deficit[prio] += sched->quantum[prio];
+                }
+        } while (eligible);
+}
+
+/*
+ * Requests behind a barrier wait until it completed. A barrier itself
+ * waits until everything ahead of it completed, and holds back whatever
+ * comes after it meanwhile.
+ *
+ * Must be called with sched->mutex held.
+ */
+static void sched_barrier_wait(struct Scheduler *sched, struct Message *req) {
+        sched->waiters++;
+        while (sched->barrier && !sched->closed) {
+                pthread_cond_wait(&sched->cond, &sched->mutex);
+        }
+        if (req->barrier) {
+                sched->barrier = 1;
+                while ((sched->total_inflight > 0 || sched->queued > 0) &&
+                                !sched->closed) {
+                        pthread_cond_wait(&sched->cond, &sched->mutex);
+                }
+        }
+        sched->waiters--;
+}
+
+/*
+ * Completion callbacks run on these threads, and what a barrier waits for
+ * can only complete through them.
+ */
+static int on_completion_thread(struct lh_client_conn *conn) {
+        pthread_t self = pthread_self();
+
+        return pthread_equal(self, conn->response_thread) ||
+                pthread_equal(self, conn->timeout_thread) ||
+                (conn->sender_running && pthread_equal(self, conn->sender_thread));
+}
+
+/*
+ * Wait for the send turn of req. Returns -EDEADLK instead of waiting on
+ * a barrier from a thread that delivers completions.
+ */
+static int sched_acquire(struct lh_client_conn *conn, struct Message *req) {
+        struct Scheduler *sched = &conn->sched;
+        int i, idle;
+
+        req->sched_cost = SCHED_REQUEST_COST +
+                (type_has_payload(req->Type) ? (uint64_t)req->Size : 0);
+
+        pthread_mutex_lock(&sched->mutex);
+        if (sched->barrier || req->barrier) {
+                if (on_completion_thread(conn)) {
+                        pthread_mutex_unlock(&sched->mutex);
+                        return -EDEADLK;
+                }
+                sched_barrier_wait(sched, req);
+        }
+        if (sched->closed) {
+                pthread_mutex_unlock(&sched->mutex);
+                return -EFAULT;
+        }
+        idle = !sched->busy;
+        for (i = 0; i < LH_CLIENT_PRIO_CLASSES && idle; i++) {
+                idle = (sched->queue[i] == NULL);
+        }
+        if (idle && sched_class_has_room(sched, req->prio)) {
+                // Nothing to arbitrate
+                sched_grant(sched, req);
+                pthread_mutex_unlock(&sched->mutex);
+                return 0;
+        }
+
+        req->sched_state = SCHED_STATE_QUEUED;
+        DL_APPEND2(sched->queue[req->prio], req, sched_prev, sched_next);
+        sched->queued++;
+        if (!sched->busy) {
+                sched_dispatch(sched);
+        }
+        sched->waiters++;
+        while (req->sched_state != SCHED_STATE_INFLIGHT && !sched->closed) {
+                pthread_cond_wait(&sched->cond, &sched->mutex);
+        }
+        sched->waiters--;
+        if (req->sched_state != SCHED_STATE_INFLIGHT) {
+                DL_DELETE2(sched->queue[req->prio], req, sched_prev, sched_next);
+                sched->queued--;
+                req->sched_state = SCHED_STATE_NONE;
+                pthread_mutex_unlock(&sched->mutex);
+                return -EFAULT;
+        }
+        pthread_mutex_unlock(&sched->mutex);
+        return 0;
+}
+
+// Whoever waits for a send turn fails instead
+static void sched_close(struct lh_client_conn *conn) {
+        struct Scheduler *sched = &conn->sched;
+
+        pthread_mutex_lock(&sched->mutex);
+        sched->closed = 1;
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+}
+
+// Give up the send turn once the request is on the socket
+static void sched_release(struct lh_client_conn *conn) {
+        struct Scheduler *sched = &conn->sched;
+
+        pthread_mutex_lock(&sched->mutex);
+        sched->busy = 0;
+        sched_dispatch(sched);
+        pthread_mutex_unlock(&sched->mutex);
+}
+
+/*
+ * AIMD on the queue depth, as in TCP congestion avoidance: one more slot
+ * per round trip of completions under the target latency, half the depth
+ * at most once per round trip when a completion is late or failed.
+ *
+ * Must be called with sched->mutex held.
+ */
+static void sched_adapt_depth(struct Scheduler *sched, struct Message *req,
+                int rc) {
+        struct lh_client_queue_depth *cfg = &sched->depth_config;
+        uint64_t now = monotonic_ns();
+        uint64_t latency = now - req->send_ns;
+
+        if (rc < 0 || latency > (uint64_t)cfg->target_latency_us * 1000) {
+                if (now - sched->last_decrease_ns < latency) {
+                        return;
+                }
+                sched->last_decrease_ns = now;
+                sched->adaptive_depth /= 2;
+                if (sched->adaptive_depth < cfg->min_depth) {
+                        sched->adaptive_depth = cfg->min_depth;
+                }
+        } else {
+                sched->adaptive_depth += 1.0 / sched->adaptive_depth;
+                if (sched->adaptive_depth > cfg->max_depth) {
+                        sched->adaptive_depth = cfg->max_depth;
+                }
+        }
+        sched->depth = (int)sched->adaptive_depth;
+}
+
+static void sched_complete(struct lh_client_conn *conn, struct Message *req,
+                int rc) {
+        struct Scheduler *sched = &conn->sched;
+
+        if (req->sched_state != SCHED_STATE_INFLIGHT) {
+                return;
+        }
+
+        pthread_mutex_lock(&sched->mutex);
+        req->sched_state = SCHED_STATE_NONE;
+        sched->inflight[req->prio]--;
+        sched->total_inflight--;
+        if ((sched->barrier || req->barrier) && sched->waiters > 0) {
+                // Either the barrier or what waits behind it may go now
+                pthread_cond_broadcast(&sched->cond);
+        }
+        if (req->barrier) {
+                sched->barrier = 0;
+        }
+        if (sched->depth_config.target_latency_us != 0) {
+                sched_adapt_depth(sched, req, rc);
+        }
+        if (!sched->busy) {
+                sched_dispatch(sched);
+        }
+        pthread_mutex_unlock(&sched->mutex);
+}
+
+static int futex_wait(uint32_t *word, uint32_t val, const struct timespec *deadline) {
+        return syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                        val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(uint32_t *word) {
+        syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+                        NULL, NULL, 0);
+}
+
+// Wake the sender thread if it sleeps, see sender_process()
+static void sender_kick(struct lh_client_conn *conn) {
+        if (__atomic_load_n(&conn->sender_sleeping, __ATOMIC_SEQ_CST) &&
+                        __atomic_exchange_n(&conn->sender_sleeping, 0, __ATOMIC_SEQ_CST)) {
+                futex_wake(&conn->sender_sleeping);
+        }
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+}
+
+void completion_init(struct Completion *comp, int pending, int needed) {
+        comp->state = 0;
+        comp->pending = pending;
+        comp->rc = 0;
+        comp->needed = needed;
+        comp->succeeded = 0;
+        comp->failed = 0;
+        comp->spin_ns = 0;
+        comp->done = NULL;
+        comp->done_arg = NULL;
+}
+
+static int completion_decided(int needed, int succeeded, int pending) {
+        if (pending == 0) {
+                return 1;
+        }
+        if (needed == 0) {
+                return 0;
+        }
+        return succeeded >= needed || succeeded + pending < needed;
+}
+
+/*
+ * Returns 0 on success, the first error otherwise. With `needed` set,
+ * success means that many members succeeded, whatever the others did.
+ * A deadline of 0 waits forever, otherwise -ETIMEDOUT is returned if
+ * nothing was decided by then.
+ */
+int wait_completion_until(struct Completion *comp, uint64_t deadline_ns) {
+        struct timespec ts = {
+                .tv_sec = deadline_ns / 1000000000ULL,
+                .tv_nsec = deadline_ns % 1000000000ULL,
+        };
+        uint64_t spin_until = 0;
+        uint32_t state;
+        int rc;
+
+        if (comp->spin_ns != 0) {
+                spin_until = monotonic_ns() + comp->spin_ns;
+        }
+
+        while (1) {
+                state = __atomic_load_n(&comp->state, __ATOMIC_ACQUIRE);
+                if (state & COMPLETION_DONE) {
+                        break;
+                }
+                if (spin_until != 0) {
+                        cpu_relax();
+                        if (monotonic_ns() >= spin_until) {
+                                spin_until = 0;
+                        }
+                        continue;
+                }
+                if (!(state & COMPLETION_WAITER)) {
+                        __atomic_compare_exchange_n(&comp->state, &state,
+                                        state | COMPLETION_WAITER, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+                        continue;
+                }
+                if (futex_wait(&comp->state, state, deadline_ns ? &ts : NULL) < 0 &&
+                                errno == ETIMEDOUT) {
+                        state = __atomic_load_n(&comp->state, __ATOMIC_ACQUIRE);
+                        if (!(state & COMPLETION_DONE)) {
+                                return -ETIMEDOUT;
+                        }
+                }
+        }
+
+        rc = __atomic_load_n(&comp->rc, __ATOMIC_RELAXED);
+        if (comp->needed != 0) {
+                if (__atomic_load_n(&comp->succeeded, __ATOMIC_RELAXED) >= comp->needed) {
+                        rc = 0;
+                } else if (rc == 0) {
+                        rc = -EIO;
+                }
+        }
+        return rc;
+}
+
+int wait_completion(struct Completion *comp) {
+        return wait_completion_until(comp, 0);
+}
+
+/*
+ * Lock free: the caller that makes the outcome decided publishes it with
+ * one exchange on the futex word and only wakes the kernel if a waiter
+ * went to sleep. The waiter may free comp right after that exchange, so
+ * nothing in comp is touched afterwards. With `needed` set the owner has
+ * to keep comp around until every member completed.
+ */
+void completion_done(struct Completion *comp, int rc) {
+        void (*done)(struct Completion *comp, void *arg) = comp->done;
+        int needed = comp->needed;
+        int expected = 0, pending;
+
+        if (rc < 0) {
+                __atomic_compare_exchange_n(&comp->rc, &expected, rc, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&comp->failed, 1, __ATOMIC_SEQ_CST);
+        } else {
+                __atomic_add_fetch(&comp->succeeded, 1, __ATOMIC_SEQ_CST);
+        }
+        pending = __atomic_sub_fetch(&comp->pending, 1, __ATOMIC_SEQ_CST);
+
+        if (done != NULL) {
+                if (pending == 0) {
+                        done(comp, comp->done_arg);
+                }
+                return;
+        }
+
+        // Without a quorum only the last one may touch comp at this point
+        if (needed == 0 ? pending == 0 : completion_decided(needed,
+                                __atomic_load_n(&comp->succeeded, __ATOMIC_SEQ_CST),
+                                pending)) {
+                if (__atomic_exchange_n(&comp->state, COMPLETION_DONE,
+                                        __ATOMIC_ACQ_REL) & COMPLETION_WAITER) {
+                        futex_wake(&comp->state);
+                }
+        }
+}
+
+// req must already be off the queue
+static void complete_request(struct lh_client_conn *conn, struct Message *req,
+                int rc) {
+        sched_complete(conn, req, rc);
+        completion_done(req->comp, rc);
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+        size_t len = 0;
+        int i;
+
+        for (i = 0; i < iovcnt; i++) {
+                len += iov[i].iov_len;
+        }
+        return len;
+}
+
+/*
+ * Cursor over an iovec array, used to carve it into segments without
+ * touching the caller's array.
+ */
+struct iov_cursor {
+        const struct iovec *iov;
+        int iovcnt;
+        int idx;
+        size_t off;
+};
+
+// Describe the next len bytes in out, returns the number of entries used
+static int iov_cursor_take(struct iov_cursor *cur, size_t len, struct iovec *out) {
+        int n = 0;
+        size_t chunk;
+
+        while (len > 0 && cur->idx < cur->iovcnt) {
+                chunk = cur->iov[cur->idx].iov_len - cur->off;
+                if (chunk > len) {
+                        chunk = len;
+                }
+                out[n].iov_base = (uint8_t *)cur->iov[cur->idx].iov_base + cur->off;
+                out[n].iov_len = chunk;
+                n++;
+
+                len -= chunk;
+                cur->off += chunk;
+                if (cur->off == cur->iov[cur->idx].iov_len) {
+                        cur->idx++;
+                        cur->off = 0;
+                }
+        }
+        return n;
+}
+
+// Describe len bytes of iov starting at byte at, returns the entries used
+static int iov_slice(const struct iovec *iov, int iovcnt, size_t at, size_t len,
+                struct iovec *out) {
+        struct iov_cursor cur = { .iov = iov, .iovcnt = iovcnt };
+
+        while (cur.idx < iovcnt && at >= iov[cur.idx].iov_len) {
+                at -= iov[cur.idx].iov_len;
+                cur.idx++;
+        }
+        cur.off = at;
+        return iov_cursor_take(&cur, len, out);
+}
+
+static void iov_zero(const struct iovec *iov, int iovcnt, size_t at, size_t len) {
+        struct iovec slice[iovcnt > 0 ? iovcnt : 1];
+        int i, n;
+
+        n = iov_slice(iov, iovcnt, at, len, slice);
+        for (i = 0; i < n; i++) {
+                memset(slice[i].iov_base, 0, slice[i].iov_len);
+        }
+}
+
+// Extents of a segment arrive in order, so most merge as they come in
+static void extent_map_add(struct ExtentMap *map, uint64_t offset,
+                uint64_t length, uint32_t flags) {
+        struct lh_client_extent *last;
+
+        if (map == NULL || length == 0) {
+                return;
+        }
+        if (map->nr > 0) {
+                last = &map->extents[map->nr - 1];
+                if (last->flags == flags && last->offset + last->length == offset) {
+                        last->length += length;
+                        return;
+                }
+        }
+        if (map->nr == map->max) {
+                map->overflow = 1;
+                return;
+        }
+        map->extents[map->nr].offset = offset;
+        map->extents[map->nr].length = length;
+        map->extents[map->nr].flags = flags;
+        map->nr++;
+}
+
+/*
+ * Receive exactly len payload bytes into iov. The part that came in with
+ * the receive buffer is copied out, the rest is read from the socket
+ * straight into place, so large payloads are not staged.
+ */
+static int receive_payload(struct lh_client_conn *conn, struct RecvBuffer *rb,
+                const struct iovec *dst, int dstcnt, uint32_t len) {
+        struct iovec iov[dstcnt > 0 ? dstcnt : 1];
+        uint32_t left = len, direct = 0;
+        size_t chunk, copied;
+        int i, iovcnt = 0;
+
+        for (i = 0; i < dstcnt && left > 0; i++) {
+                chunk = dst[i].iov_len < left ? dst[i].iov_len : left;
+                left -= chunk;
+
+                copied = recv_buffer_take(rb, dst[i].iov_base, chunk);
+                if (copied < chunk) {
+                        iov[iovcnt].iov_base = (uint8_t *)dst[i].iov_base + copied;
+                        iov[iovcnt].iov_len = chunk - copied;
+                        direct += chunk - copied;
+                        iovcnt++;
+                }
+        }
+
+        if (iovcnt == 0) {
+                return 0;
+        }
+        return receive_msg_data(conn->fd, iov, iovcnt, direct);
+}
+
+/*
+ * Move the payload of resp into the buffers of req. Anything beyond what
+ * req asked for is drained and fails the request. A read answered with
+ * TypeEOF got only the part inside the volume, the rest reads as zeros.
+ */
+static int receive_response_data(struct lh_client_conn *conn,
+                struct RecvBuffer *rb, struct Message *req, struct Message *resp) {
+        size_t room = iov_length(req->iov, req->iovcnt);
+        uint32_t len = resp->DataLength < room ? resp->DataLength : room;
+        int rc;
+
+        rc = receive_payload(conn, rb, req->iov, req->iovcnt, len);
+        if (rc < 0) {
+                return rc;
+        }
+        if (len < resp->DataLength) {
+                LOG_ERROR("Response %d carries %u bytes more than requested",
+                                resp->Seq, resp->DataLength - len);
+                rc = recv_buffer_discard(conn->fd, rb, resp->DataLength - len);
+                if (rc < 0) {
+                        return rc;
+                }
+                resp->Type = TypeError;
+                return 0;
+        }
+
+        if (req->Type == TypeRead) {
+                extent_map_add(req->map, req->Offset, len, 0);
+                if (resp->Type == TypeEOF && len < req->Size) {
+                        iov_zero(req->iov, req->iovcnt, len, req->Size - len);
+                        extent_map_add(req->map, req->Offset + len,
+                                        req->Size - len, LH_CLIENT_EXTENT_HOLE);
+                }
+        }
+        return 0;
+}
+
+/*
+ * TypeSparseResponse: an extent table covering the read range, then the
+ * bytes of its data extents. Data lands in place, holes and zero ranges
+ * are cleared locally. A response that doesn't add up is drained and
+ * fails the request.
+ */
+static int receive_sparse_data(struct lh_client_conn *conn,
+                struct RecvBuffer *rb, struct Message *req, struct Message *resp) {
+        struct iovec slice[req->iovcnt > 0 ? req->iovcnt : 1];
+        struct ExtentEntry *table;
+        struct iovec table_iov;
+        uint64_t pos = 0, offset, length;
+        uint32_t left = resp->DataLength, flags, i;
+        size_t table_len = (size_t)resp->Size * sizeof(struct ExtentEntry);
+        int n, rc = 0, bad = 0;
+
+        if (resp->Size == 0 || table_len > left) {
+                LOG_ERROR("Malformed sparse response %d", resp->Seq);
+                goto drain;
+        }
+
+        table = malloc(table_len);
+        if (table == NULL) {
+                LOG_ERROR("cannot allocate extent table for response %d", resp->Seq);
+                goto drain;
+        }
+        table_iov.iov_base = table;
+        table_iov.iov_len = table_len;
+        rc = receive_payload(conn, rb, &table_iov, 1, table_len);
+        if (rc < 0) {
+                free(table);
+                return rc;
+        }
+        left -= table_len;
+
+        for (i = 0; i < resp->Size; i++) {
+                offset = le64toh(table[i].Offset);
+                length = le32toh(table[i].Length);
+                flags = le32toh(table[i].Flags) & (ExtentHole | ExtentZero);
+                if (offset != (uint64_t)req->Offset + pos || length > req->Size - pos ||
+                                (flags == 0 && length > left)) {
+                        bad = 1;
+                        break;
+                }
+                if (flags == 0) {
+                        n = iov_slice(req->iov, req->iovcnt, pos, length, slice);
+                        rc = receive_payload(conn, rb, slice, n, length);
+                        if (rc < 0) {
+                                free(table);
+                                return rc;
+                        }
+                        left -= length;
+                } else {
+                        iov_zero(req->iov, req->iovcnt, pos, length);
+                }
+                pos += length;
+        }
+        if (!bad && pos == req->Size && left == 0) {
+                // Only now, a response cut short is replayed and seen again
+                for (i = 0; i < resp->Size; i++) {
+                        extent_map_add(req->map, le64toh(table[i].Offset),
+                                        le32toh(table[i].Length),
+                                        le32toh(table[i].Flags) & (ExtentHole | ExtentZero));
+                }
+                free(table);
+                return 0;
+        }
+        free(table);
+        LOG_ERROR("Sparse response %d doesn't match the read", resp->Seq);
+
+drain:
+        resp->Type = TypeError;
+        return recv_buffer_discard(conn->fd, rb, left);
 }
 
-// Must be called with conn->msg_mutex hold
-void update_timeout_timer(struct lh_client_conn *conn) {
-        struct Message *head_msg = conn->msg_list;
+/*
+ * Request timeouts are checked lazily: taking requests off the queue only
+ * records the time in last_progress_ns. The timer is armed when the queue
+ * stops being empty, and when it fires the timeout thread either fails
+ * the queue or pushes the timer out to request_timeout after the last
+ * progress. So timerfd_settime() runs about once per request_timeout
+ * rather than once per response, with the same deadline as before.
+ *
+ * Both must be called with conn->msg_mutex hold.
+ */
+static void arm_timeout_timer(struct lh_client_conn *conn, uint64_t deadline_ns) {
         struct itimerspec its;
-        its.it_value.tv_sec = 0;
-        its.it_value.tv_nsec = 0;
+
+        its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+        its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
         its.it_interval.tv_sec = 0;
         its.it_interval.tv_nsec = 0;
 
-        // When there are messages on the queue, make timer that expires
-        // request_timeout seconds from now.
-        if (head_msg != NULL) {
-                if (clock_gettime(CLOCK_MONOTONIC, &its.it_value) < 0) {
-                        LOG_ERROR("Fail to get current time");
-                        return;
-                }
+        if (timerfd_settime(conn->timeout_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+                LOG_ERROR("BUG: Fail to set new timer");
+                return;
+        }
+        conn->timer_armed = 1;
+}
+
+static void note_queue_progress(struct lh_client_conn *conn) {
+        conn->last_progress_ns = monotonic_ns();
+        if (!conn->timer_armed && conn->msg_list != NULL) {
+                arm_timeout_timer(conn, conn->last_progress_ns +
+                                conn->request_timeout * 1000000000ULL);
+        }
+}
+
+/*
+ * *replays tells send_request() whether a reconnect replayed req since it
+ * was queued. Fails once close has drained the queue.
+ */
+static int add_request_in_queue(struct lh_client_conn *conn, struct Message *req,
+                uint32_t *replays) {
+        int start_timer = 0;
+
+        pthread_mutex_lock(&conn->msg_mutex);
+        if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) ==
+                        CLIENT_CONN_STATE_CLOSE) {
+                pthread_mutex_unlock(&conn->msg_mutex);
+                return -EFAULT;
+        }
+        *replays = conn->replays;
+
+        // Start the clock on this message if there are no other in progress
+        // messages. This allows us to have a timeout in case the there is
+        // only one message on the queue and we don't receive a response.
+        start_timer = (conn->msg_list == NULL);
+
+        HASH_ADD_INT(conn->msg_hashtable, Seq, req);
+        DL_APPEND(conn->msg_list, req);
+
+        if (start_timer) {
+                note_queue_progress(conn);
+        }
+
+        pthread_mutex_unlock(&conn->msg_mutex);
+        return 0;
+}
+
+// Put a taken request back, or fail it if close already drained the queue
+static void requeue_request(struct lh_client_conn *conn, struct Message *req) {
+        pthread_mutex_lock(&conn->msg_mutex);
+        if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) !=
+                        CLIENT_CONN_STATE_CLOSE) {
+                HASH_ADD_INT(conn->msg_hashtable, Seq, req);
+                DL_APPEND(conn->msg_list, req);
+                pthread_mutex_unlock(&conn->msg_mutex);
+                return;
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+        complete_request(conn, req, -EFAULT);
+}
+
+static struct Message *find_and_remove_request_from_queue(struct lh_client_conn *conn,
+                int seq) {
+        struct Message *req = NULL;
+
+        pthread_mutex_lock(&conn->msg_mutex);
+        HASH_FIND_INT(conn->msg_hashtable, &seq, req);
+        if (req != NULL) {
+                HASH_DEL(conn->msg_hashtable, req);
+                DL_DELETE(conn->msg_list, req);
+                // When we find a message on the queue, the deadline moves to
+                // request_timeout seconds from now.  This ensures that when
+                // messages are on the queue, we should receive some kind of
+                // response to one of the messages on the queue every
+                // request_timeout seconds.
+                note_queue_progress(conn);
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+        return req;
+}
+
+int lh_client_close_conn(struct lh_client_conn *conn) {
+        struct Message *req, *tmp, *failed = NULL;
+        int self;
+
+        if (conn == NULL) {
+                return 0;
+        }
+
+        LOG_INFO("Closing connection");
+
+        pthread_mutex_lock(&conn->mutex);
+        if  (conn->state == CLIENT_CONN_STATE_CLOSE) {
+                pthread_mutex_unlock(&conn->mutex);
+                return 0;
+        }
+
+        // Prevent future requests. Atomic for the sender thread and its
+        // submitters, which check it without the lock.
+        __atomic_store_n(&conn->state, CLIENT_CONN_STATE_CLOSE, __ATOMIC_SEQ_CST);
+        // From the response thread, cancelling ourselves would end us at
+        // the first join below with the other threads still running
+        self = pthread_equal(pthread_self(), conn->response_thread);
+        conn->response_closed = self;
+        close(conn->timeout_fd);
+        // Wakes up whoever is blocked on the socket. It is closed once
+        // nobody uses it any more, so its number can't be reused under us.
+        shutdown(conn->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&conn->mutex);
+
+        pthread_mutex_lock(&conn->msg_mutex);
+        // Clean up and fail all pending requests
+        HASH_ITER(hh, conn->msg_hashtable, req, tmp) {
+                HASH_DEL(conn->msg_hashtable, req);
+                DL_DELETE(conn->msg_list, req);
+                DL_APPEND(failed, req);
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+
+        // Completion callbacks may queue new requests, so run them unlocked
+        DL_FOREACH_SAFE(failed, req, tmp) {
+                DL_DELETE(failed, req);
+                LOG_ERROR("Cancel request %d due to disconnection", req->Seq);
+                complete_request(conn, req, -EFAULT);
+        }
+        sched_close(conn);
+
+        if (conn->unmap_running) {
+                // Fails what is parked; runs it already sent fail on
+                // their own. Before the sender, which may carry them, and
+                // while no thread is being cancelled.
+                pthread_mutex_lock(&conn->unmap_mutex);
+                pthread_cond_broadcast(&conn->unmap_cond);
+                pthread_mutex_unlock(&conn->unmap_mutex);
+                if (pthread_join(conn->unmap_thread, NULL) < 0) {
+                        LOG_ERROR("Cannot wait for unmap thread");
+                }
+                conn->unmap_running = 0;
+        }
+        if (pthread_cancel(conn->timeout_thread) < 0) {
+                LOG_ERROR("Cannot cancel timeout thread");
+        }
+        if (!self && pthread_cancel(conn->response_thread) < 0) {
+                LOG_ERROR("Cannot cancel response thread");
+        }
+        if (pthread_join(conn->timeout_thread, NULL) < 0) {
+                LOG_ERROR("Cannot wait for timeout thread");
+        }
+        if (!self && pthread_join(conn->response_thread, NULL) < 0) {
+                LOG_ERROR("Cannot wait for response thread");
+        }
+        if (conn->sender_running) {
+                sender_kick(conn);
+                if (pthread_join(conn->sender_thread, NULL) < 0) {
+                        LOG_ERROR("Cannot wait for sender thread");
+                }
+                conn->sender_running = 0;
+        }
+        close(conn->fd);
+        LOG_ERROR("Connection close complete");
+        return 0;
+}
+
+static int new_seq(struct lh_client_conn *conn) {
+        return __sync_fetch_and_add(&conn->seq, 1);
+}
+
+/*
+ * Ask the replica on fd for the features we want, before anything else
+ * goes out on it and before fd is published, so nothing waits for us.
+ * Done on every connect, so a reconnect to another replica build doesn't
+ * keep what the old one agreed to. A replica that answers with an error,
+ * or not within FEATURES_TIMEOUT_MS because it ignores unknown types,
+ * gets none; a late answer is recognized by its Seq and dropped. Fails
+ * only if the socket broke.
+ */
+static int negotiate_features(struct lh_client_conn *conn, int fd) {
+        uint8_t header[MAX_HEADER_SIZE];
+        struct Message req, resp;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int rc;
+
+        conn->features = 0;
+        conn->features_late = 0;
+        if (conn->features_wanted == 0) {
+                return 0;
+        }
+
+        bzero(&req, sizeof(req));
+        req.Seq = new_seq(conn);
+        req.Type = TypeFeatures;
+        req.Size = conn->features_wanted;
+        rc = send_msg(fd, &req, header, sizeof(header));
+        if (rc < 0) {
+                return rc;
+        }
+
+        rc = poll(&pfd, 1, FEATURES_TIMEOUT_MS);
+        if (rc == 0) {
+                LOG_INFO("Replica doesn't answer feature negotiation, using none");
+                conn->features_late_seq = req.Seq;
+                conn->features_late = 1;
+                return 0;
+        }
+        if (rc < 0 || receive_msg_header(fd, &resp, header,
+                                sizeof(struct MessageHeader)) < 0) {
+                LOG_ERROR("Fail to receive feature negotiation response");
+                return -EFAULT;
+        }
+        if (resp.Seq != req.Seq) {
+                LOG_ERROR("Unexpected response %d to feature negotiation", resp.Seq);
+                return -EFAULT;
+        }
+        if (resp.DataLength != 0 && discard_msg_data(fd, resp.DataLength) < 0) {
+                return -EFAULT;
+        }
+        if (resp.Type == TypeResponse) {
+                conn->features = resp.Size & conn->features_wanted;
+        } else {
+                LOG_INFO("Replica doesn't negotiate features, using none");
+        }
+        return 0;
+}
+
+/*
+ * Called by the response thread after the socket broke. Re-dials with
+ * exponential backoff, then resends everything still on the queue. All
+ * request types on the queue are positional reads, writes and unmaps, so
+ * replaying them is idempotent.
+ */
+static int reconnect_conn(struct lh_client_conn *conn) {
+        struct Message *req, *tmp, *failed = NULL, *unsupported = NULL;
+        uint64_t start, latency;
+        int fd, rc, oldstate, broken;
+        int replayed = 0;
+
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->state != CLIENT_CONN_STATE_OPEN) {
+                pthread_mutex_unlock(&conn->mutex);
+                return -EFAULT;
+        }
+        conn->state = CLIENT_CONN_STATE_RECONNECTING;
+        close(conn->fd);
+        conn->fd = -1;
+        pthread_mutex_unlock(&conn->mutex);
+
+        LOG_INFO("Connection to %s lost, reconnecting", conn->socket_path);
+
+        start = monotonic_ns();
+        fd = dial_with_backoff(conn, &conn->reconnect_backoff, still_reconnecting);
+
+        // Don't get cancelled by lh_client_close_conn() with locks held
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+        // Submitters don't wait on the locks meanwhile
+        broken = fd >= 0 && negotiate_features(conn, fd) < 0;
+
+        pthread_mutex_lock(&conn->msg_mutex);
+        pthread_mutex_lock(&conn->mutex);
+        if (fd < 0 || conn->state != CLIENT_CONN_STATE_RECONNECTING) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                conn->stats.reconnect_failures++;
+                pthread_mutex_unlock(&conn->mutex);
+                pthread_mutex_unlock(&conn->msg_mutex);
+                pthread_setcancelstate(oldstate, NULL);
+                LOG_ERROR("Fail to reconnect to %s", conn->socket_path);
+                return -EFAULT;
+        }
+
+        conn->fd = fd;
+        // Answers to cancelled requests went down with the old socket
+        __sync_lock_test_and_set(&conn->cancelled, 0);
+        if (broken) {
+                // Broken again, the response thread will retry
+                shutdown(conn->fd, SHUT_RDWR);
+        }
+        // Whatever is queued now goes out here, not from its submitter
+        conn->replays++;
+        DL_FOREACH_SAFE(conn->msg_list, req, tmp) {
+                if (req->no_replay) {
+                        HASH_DEL(conn->msg_hashtable, req);
+                        DL_DELETE(conn->msg_list, req);
+                        DL_APPEND(failed, req);
+                        continue;
+                }
+                if (request_fit_flags(conn, req) < 0) {
+                        HASH_DEL(conn->msg_hashtable, req);
+                        DL_DELETE(conn->msg_list, req);
+                        DL_APPEND(unsupported, req);
+                        continue;
+                }
+                rc = send_msg(conn->fd, req, conn->request_header,
+                                conn->header_size);
+                if (rc < 0) {
+                        // Broken again, the response thread will retry
+                        shutdown(conn->fd, SHUT_RDWR);
+                        break;
+                }
+                replayed++;
+        }
+        conn->state = CLIENT_CONN_STATE_OPEN;
+
+        latency = (monotonic_ns() - start) / 1000;
+        conn->stats.reconnects++;
+        conn->stats.replayed_requests += replayed;
+        conn->stats.last_reconnect_latency_us = latency;
+        conn->stats.total_reconnect_latency_us += latency;
+        if (latency > conn->stats.max_reconnect_latency_us) {
+                conn->stats.max_reconnect_latency_us = latency;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        // Replayed requests get a full request_timeout again
+        if (conn->msg_list != NULL) {
+                note_queue_progress(conn);
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+        pthread_setcancelstate(oldstate, NULL);
+
+        DL_FOREACH_SAFE(failed, req, tmp) {
+                DL_DELETE(failed, req);
+                complete_request(conn, req, -EIO);
+        }
+        DL_FOREACH_SAFE(unsupported, req, tmp) {
+                DL_DELETE(unsupported, req);
+                LOG_ERROR("Replica no longer takes request flags, failing request %d",
+                                req->Seq);
+                complete_request(conn, req, -EOPNOTSUPP);
+        }
+
+        LOG_INFO("Reconnected to %s in %lu us, replayed %d requests",
+                        conn->socket_path, (unsigned long)latency, replayed);
+        return 0;
+}
+
+/*
+ * Peek at the socket without blocking for up to the busy poll budget, so
+ * a response that shows up soon is read without a scheduler wakeup. Only
+ * worth it while requests are outstanding. Data, EOF or an error all end
+ * the spin; the blocking read that follows deals with them.
+ */
+static void response_busy_poll(struct lh_client_conn *conn) {
+        uint64_t budget = __atomic_load_n(&conn->busy_poll_ns, __ATOMIC_RELAXED);
+        uint64_t until;
+        char c;
+
+        if (budget == 0 || __atomic_load_n(&conn->msg_list, __ATOMIC_RELAXED) == NULL) {
+                return;
+        }
+
+        until = monotonic_ns() + budget;
+        do {
+                if (recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+                                (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                 errno != EINTR)) {
+                        return;
+                }
+                cpu_relax();
+        } while (monotonic_ns() < until);
+}
+
+/*
+ * Threads of a connection start on its CPUs, cpu >= 0 overrides that for
+ * one thread. Returns 0 when there is nothing to apply.
+ */
+static int thread_attr_init(struct lh_client_conn *conn, pthread_attr_t *attr,
+                int cpu) {
+        cpu_set_t one;
+
+        if (cpu < 0 && !conn->affinity_set) {
+                return 0;
+        }
+
+        pthread_attr_init(attr);
+        if (cpu >= 0) {
+                CPU_ZERO(&one);
+                CPU_SET(cpu, &one);
+                pthread_attr_setaffinity_np(attr, sizeof(one), &one);
+        } else {
+                pthread_attr_setaffinity_np(attr, sizeof(conn->cpus), &conn->cpus);
+        }
+        return 1;
+}
+
+static int thread_create(struct lh_client_conn *conn, pthread_t *thread,
+                void *(*fn)(void *), int cpu) {
+        pthread_attr_t attr;
+        int rc;
+
+        if (!thread_attr_init(conn, &attr, cpu)) {
+                return pthread_create(thread, NULL, fn, conn);
+        }
+        rc = pthread_create(thread, &attr, fn, conn);
+        pthread_attr_destroy(&attr);
+        return rc;
+}
+
+/*
+ * Prefer the connection's node for everything the calling thread
+ * allocates from now on, so the buffers a connection thread sets up for
+ * itself are local to it.
+ */
+static void thread_bind_memory(struct lh_client_conn *conn) {
+        unsigned long mask[4] = { 0 };
+
+        if (conn->numa_node < 0) {
+                return;
+        }
+
+        mask[conn->numa_node / (8 * sizeof(long))] |=
+                1UL << (conn->numa_node % (8 * sizeof(long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                                sizeof(mask) * 8) < 0) {
+                LOG_ERROR("Fail to prefer memory of node %d", conn->numa_node);
+        }
+}
+
+static int response_expected(struct Message *resp) {
+        return resp->Type != TypeRead && resp->Type != TypeWrite &&
+                resp->Type != TypeUnmap;
+}
+
+/*
+ * Take the requests answered by a batch of responses off the queue in one
+ * msg_mutex hold, touching the timer once for the whole batch. reqs[i] is
+ * NULL when resps[i] matches nothing. Stops at a close message and
+ * returns how many responses were looked at.
+ */
+static int take_answered_requests(struct lh_client_conn *conn,
+                struct Message *resps, struct Message **reqs, int n) {
+        int i, found = 0;
+
+        pthread_mutex_lock(&conn->msg_mutex);
+        for (i = 0; i < n && resps[i].Type != TypeClose; i++) {
+                reqs[i] = NULL;
+                if (!response_expected(&resps[i])) {
+                        continue;
+                }
+                HASH_FIND_INT(conn->msg_hashtable, &resps[i].Seq, reqs[i]);
+                if (reqs[i] != NULL) {
+                        HASH_DEL(conn->msg_hashtable, reqs[i]);
+                        DL_DELETE(conn->msg_list, reqs[i]);
+                        found++;
+                }
+        }
+        if (found > 0) {
+                note_queue_progress(conn);
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+        return i;
+}
+
+/*
+ * Consume the payload of resp, which starts at rb->start, into req if it
+ * is the answer to one. Returns a negative error when the stream broke.
+ */
+static int response_receive(struct lh_client_conn *conn, struct RecvBuffer *rb,
+                struct Message *resp, struct Message *req) {
+        switch (resp->Type) {
+        case TypeRead:
+        case TypeWrite:
+        case TypeUnmap:
+                LOG_ERROR("Wrong type for response %d of seq %d",
+                                resp->Type, resp->Seq);
+                return recv_buffer_discard(conn->fd, rb, resp->DataLength);
+        case TypeError:
+        case TypeENOSPC:
+                LOG_ERROR("Receive error for response %d of seq %d",
+                                resp->Type, resp->Seq);
+                /* fall through so we can response to caller */
+        case TypeEOF:
+        case TypeResponse:
+        case TypeSparseResponse:
+                break;
+        default:
+                LOG_ERROR("Unknown message type %d", resp->Type);
+        }
+
+        if (req == NULL) {
+                if (conn->features_late && resp->Seq == conn->features_late_seq) {
+                        // Negotiation gave up on it already
+                        conn->features_late = 0;
+                } else if (__sync_fetch_and_add(&conn->cancelled, 0) > 0) {
+                        // Most likely the answer to a cancelled request
+                        __sync_fetch_and_sub(&conn->cancelled, 1);
+                } else {
+                        LOG_ERROR("Unknown response sequence %d", resp->Seq);
+                }
+                return recv_buffer_discard(conn->fd, rb, resp->DataLength);
+        }
+
+        // Control requests get their result in Size, keep ours for a replay
+        if (req->Type == TypeExtents) {
+                req->result = resp->Size;
+        }
+        if (req->Type == TypeExtents && resp->Type == TypeResponse &&
+                        (resp->Size > MaxExtentEntries || resp->DataLength !=
+                         resp->Size * sizeof(struct ExtentEntry))) {
+                LOG_ERROR("Malformed extent map in response %d", resp->Seq);
+                resp->Type = TypeError;
+        }
+
+        // The request is off the queue, so nobody else touches its
+        // buffers until it is signalled.
+        if (resp->Type == TypeSparseResponse && req->Type == TypeRead) {
+                return receive_sparse_data(conn, rb, req, resp);
+        }
+        if ((resp->Type == TypeResponse || resp->Type == TypeEOF) &&
+                        (resp->DataLength != 0 || req->Type == TypeRead)) {
+                return receive_response_data(conn, rb, req, resp);
+        }
+        return recv_buffer_discard(conn->fd, rb, resp->DataLength);
+}
+
+static int response_status(struct Message *resp) {
+        if (resp->Type == TypeResponse || resp->Type == TypeEOF ||
+                        resp->Type == TypeSparseResponse) {
+                return 0;
+        } else if (resp->Type == TypeENOSPC) {
+                return -ENOSPC;
+        }
+        return -EFAULT;
+}
+
+/*
+ * Handle a batch of decoded responses, the first payload starting at
+ * data_at[0] in rb. Requests are taken off the queue together, filled in
+ * order and then completed together, so callers are woken in one burst
+ * after the receive cycle. Returns 1 when the replica closed the
+ * connection, a negative error when the stream broke.
+ */
+static int response_handle_batch(struct lh_client_conn *conn,
+                struct RecvBuffer *rb, struct Message *resps,
+                const size_t *data_at, int n) {
+        struct Message *reqs[RESPONSE_BATCH];
+        size_t base = rb->start;
+        int i, m, done = 0, ret = 0, oldstate;
+
+        // Taken requests must be completed or put back, so no cancel from
+        // lh_client_close_conn() until then; it shuts the socket down to
+        // get us out of a blocked read instead
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        m = take_answered_requests(conn, resps, reqs, n);
+        for (i = 0; i < m; i++) {
+                rb->start = base + data_at[i];
+                ret = response_receive(conn, rb, &resps[i], reqs[i]);
+                if (ret < 0) {
+                        break;
+                }
+                done = i + 1;
+        }
+
+        // Put back what was not filled in, it gets replayed or failed
+        // together with the rest of the queue
+        for (i = done; i < m; i++) {
+                if (reqs[i] != NULL) {
+                        requeue_request(conn, reqs[i]);
+                }
+        }
+
+        for (i = 0; i < done; i++) {
+                if (reqs[i] != NULL) {
+                        complete_request(conn, reqs[i], response_status(&resps[i]));
+                }
+        }
+        pthread_setcancelstate(oldstate, NULL);
+
+        if (ret < 0) {
+                return ret;
+        }
+        if (m < n) {
+                LOG_ERROR("Receive close message, about to end the connection");
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Responses are read in bulk: one read() pulls in whatever the socket
+ * has, then every complete response in the buffer is handled before the
+ * next read, so small IO costs a fraction of a syscall per response.
+ */
+static void* response_process(void *arg) {
+        struct lh_client_conn *conn = arg;
+        struct RecvBuffer rb;
+        struct Message *resps;
+        size_t data_at[RESPONSE_BATCH];
+        int n, ret = 0;
+
+        thread_bind_memory(conn);
+
+        resps = malloc(sizeof(struct Message) * RESPONSE_BATCH);
+        if (resps == NULL) {
+            LOG_ERROR("cannot allocate memory for resp");
+            return NULL;
+        }
+        if (recv_buffer_init(&rb, RECV_BUFFER_SIZE) < 0) {
+                LOG_ERROR("cannot allocate receive buffer");
+                free(resps);
+                return NULL;
+        }
+
+        // lh_client_close_conn() cancels this thread in the middle of a read
+        pthread_cleanup_push(free, resps);
+        pthread_cleanup_push(free, rb.data);
+        while (1) {
+                n = decode_msg_headers(rb.data + rb.start, rb.end - rb.start,
+                                resps, data_at, RESPONSE_BATCH);
+                if (n == 0) {
+                        response_busy_poll(conn);
+                        ret = recv_buffer_fill(conn->fd, &rb);
+                } else if (n < 0) {
+                        ret = n;
+                } else {
+                        ret = response_handle_batch(conn, &rb, resps, data_at, n);
+                        if (ret > 0) {
+                                ret = 0;
+                                break;
+                        }
+                }
+
+                if (ret < 0) {
+                        if (reconnect_enabled(conn) && reconnect_conn(conn) == 0) {
+                                // What is buffered belongs to the old stream
+                                rb.start = rb.end = 0;
+                                ret = 0;
+                                continue;
+                        }
+                        break;
+                }
+        }
+        pthread_cleanup_pop(1);
+        pthread_cleanup_pop(1);
+        if (ret != 0) {
+                LOG_ERROR("Receive response returned error");
+        }
+        lh_client_close_conn(conn);
+        return NULL;
+}
+
+// The request a queued message is a segment of
+static struct Request *request_of(struct Message *req) {
+        return (struct Request *)((char *)req->comp - offsetof(struct Request, comp));
+}
+
+static void *timeout_handler(void *arg) {
+        struct lh_client_conn *conn = arg;
+        int ret;
+        int nfds = 1;
+        struct pollfd *fds;
+        struct Message *req, *tmp, *failed;
+        uint64_t expirations, deadline;
+        int kept;
+
+        thread_bind_memory(conn);
+        fds = malloc(sizeof(struct pollfd) * nfds);
+
+        fds[0].fd = conn->timeout_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        while (1) {
+                ret = poll(fds, nfds, -1);
+                if (ret < 0) {
+                        LOG_ERROR("Fail to poll timeout fd");
+                        break;
+                }
+                if (fds[0].revents == POLLHUP) {
+                        LOG_ERROR("Timeout fd closed");
+                        break;
+                }
+                if (ret != 1 || fds[0].revents != POLLIN) {
+                        LOG_ERROR("BUG: Timeout fd polling have unexpected result");
+                        break;
+                }
+
+                // Consume the expiration, the fd stays readable until then
+                if (read(conn->timeout_fd, &expirations, sizeof(expirations)) < 0 &&
+                                errno != EAGAIN) {
+                        LOG_ERROR("BUG: Fail to read timeout fd");
+                        break;
+                }
+
+                failed = NULL;
+                pthread_mutex_lock(&conn->msg_mutex);
+                conn->timer_armed = 0;
+                if (conn->msg_list != NULL) {
+                        deadline = conn->last_progress_ns +
+                                conn->request_timeout * 1000000000ULL;
+                        if (monotonic_ns() < deadline) {
+                                // Responses came in since the timer was set
+                                arm_timeout_timer(conn, deadline);
+                        } else {
+                                kept = 0;
+                                DL_FOREACH_SAFE(conn->msg_list, req, tmp) {
+                                        if (__atomic_load_n(&request_of(req)->pinned,
+                                                                __ATOMIC_ACQUIRE) != 0) {
+                                                // The sender thread still reads
+                                                // its payload, the caller can't
+                                                // have it back yet
+                                                kept = 1;
+                                                continue;
+                                        }
+                                        HASH_DEL(conn->msg_hashtable, req);
+                                        DL_DELETE(conn->msg_list, req);
+                                        DL_APPEND(failed, req);
+                                }
+                                if (kept) {
+                                        arm_timeout_timer(conn, monotonic_ns() +
+                                                        conn->request_timeout * 1000000000ULL);
+                                }
+                        }
+                }
+                pthread_mutex_unlock(&conn->msg_mutex);
+
+                DL_FOREACH_SAFE(failed, req, tmp) {
+                        DL_DELETE(failed, req);
+                        LOG_ERROR("Timeout request %d due to disconnection", req->Seq);
+                        complete_request(conn, req, -EFAULT);
+                }
+        }
+        free(fds);
+	return NULL;
+}
+
+/*
+ * Sender mode: submitters push their segments onto conn->send_stack, a
+ * lock-free LIFO, and a single sender thread takes the whole stack at
+ * once and writes it in large vectored writes. Until the sender takes a
+ * request it is not on the message queue, so close, timeouts, replay and
+ * cancellation never see it and the sender owns it alone.
+ */
+static void sender_push(struct lh_client_conn *conn, struct Message *req) {
+        struct Message *head = __atomic_load_n(&conn->send_stack, __ATOMIC_RELAXED);
+
+        do {
+                req->send_next = head;
+        } while (!__atomic_compare_exchange_n(&conn->send_stack, &head, req, 1,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// The sender is done with the payload of req, whatever became of it
+static void sender_unpin(struct Message *req) {
+        struct Request *r = request_of(req);
+
+        if (__atomic_sub_fetch(&r->pinned, 1, __ATOMIC_ACQ_REL) == 0) {
+                futex_wake(&r->pinned);
+                request_free(r);
+        }
+}
+
+// Queue n requests for their responses and write them to the socket
+static void sender_send(struct lh_client_conn *conn, struct Message **msgs, int n) {
+        uint8_t headers[SENDER_BATCH * MAX_HEADER_SIZE];
+        struct Message *req, *unsupported[SENDER_BATCH];
+        int seqs[SENDER_BATCH];
+        int i, j, rc, start_timer, nr_unsupported = 0;
+
+        // conn->mutex stays held until the write is done, so a reconnect
+        // can't replay these before they went out once
+        pthread_mutex_lock(&conn->msg_mutex);
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->state == CLIENT_CONN_STATE_CLOSE) {
+                pthread_mutex_unlock(&conn->mutex);
+                pthread_mutex_unlock(&conn->msg_mutex);
+                for (i = 0; i < n; i++) {
+                        complete_request(conn, msgs[i], -EFAULT);
+                        sender_unpin(msgs[i]);
+                }
+                return;
+        }
+        start_timer = (conn->msg_list == NULL);
+        for (i = 0, j = 0; i < n; i++) {
+                if (conn->state == CLIENT_CONN_STATE_OPEN &&
+                                request_fit_flags(conn, msgs[i]) < 0) {
+                        unsupported[nr_unsupported++] = msgs[i];
+                        continue;
+                }
+                msgs[j] = msgs[i];
+                seqs[j] = msgs[j]->Seq;
+                HASH_ADD_INT(conn->msg_hashtable, Seq, msgs[j]);
+                DL_APPEND(conn->msg_list, msgs[j]);
+                j++;
+        }
+        n = j;
+        if (start_timer && n > 0) {
+                note_queue_progress(conn);
+        }
+        pthread_mutex_unlock(&conn->msg_mutex);
+
+        if (conn->state == CLIENT_CONN_STATE_RECONNECTING) {
+                // Queued, they will be replayed once the socket is back
+                pthread_mutex_unlock(&conn->mutex);
+                for (i = 0; i < n; i++) {
+                        sender_unpin(msgs[i]);
+                }
+                return;
+        }
+        rc = send_msgs(conn->fd, msgs, n, headers);
+        if (rc < 0 && reconnect_enabled(conn)) {
+                LOG_ERROR("Fail to send %d requests, waiting for reconnection", n);
+                shutdown(conn->fd, SHUT_RDWR);
+                rc = 0;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        for (i = 0; i < nr_unsupported; i++) {
+                complete_request(conn, unsupported[i], -EOPNOTSUPP);
+                sender_unpin(unsupported[i]);
+        }
+        if (rc < 0) {
+                for (i = 0; i < n; i++) {
+                        req = find_and_remove_request_from_queue(conn, seqs[i]);
+                        if (req != NULL) {
+                                complete_request(conn, req, rc);
+                        }
+                }
+        }
+        for (i = 0; i < n; i++) {
+                sender_unpin(msgs[i]);
+        }
+}
+
+// Send a list taken off conn->send_stack in submission order
+static void sender_flush(struct lh_client_conn *conn, struct Message *list) {
+        struct Message *msgs[SENDER_BATCH];
+        struct Message *ordered = NULL, *next;
+        int n;
+
+        while (list != NULL) {
+                next = list->send_next;
+                list->send_next = ordered;
+                ordered = list;
+                list = next;
+        }
+
+        while (ordered != NULL) {
+                for (n = 0; n < SENDER_BATCH && ordered != NULL; n++) {
+                        msgs[n] = ordered;
+                        ordered = ordered->send_next;
+                }
+                sender_send(conn, msgs, n);
+        }
+}
+
+static void *sender_process(void *arg) {
+        struct lh_client_conn *conn = arg;
+        struct Message *list;
+
+        thread_bind_memory(conn);
+
+        while (1) {
+                list = __atomic_exchange_n(&conn->send_stack, NULL, __ATOMIC_SEQ_CST);
+                if (list != NULL) {
+                        sender_flush(conn, list);
+                        continue;
+                }
+                if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) ==
+                                CLIENT_CONN_STATE_CLOSE) {
+                        // Fail what got pushed meanwhile, submitters that
+                        // come later see the close and fail their own
+                        list = __atomic_exchange_n(&conn->send_stack, NULL,
+                                        __ATOMIC_SEQ_CST);
+                        if (list != NULL) {
+                                sender_flush(conn, list);
+                        }
+                        break;
+                }
+
+                __atomic_store_n(&conn->sender_sleeping, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&conn->send_stack, __ATOMIC_SEQ_CST) == NULL &&
+                                __atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) !=
+                                CLIENT_CONN_STATE_CLOSE) {
+                        futex_wait(&conn->sender_sleeping, 1, NULL);
+                }
+                __atomic_store_n(&conn->sender_sleeping, 0, __ATOMIC_SEQ_CST);
+        }
+        return NULL;
+}
+
+/*
+ * Unmap coalescing: unmaps are parked on conn->unmap_pending instead of
+ * being sent. The unmap thread waits out the window from the first one,
+ * or until the byte cap, then sorts what piled up and sends each run of
+ * adjacent or overlapping ranges as one TypeUnmap. Parked requests are
+ * never on the message queue; they complete when their run does.
+ */
+static void unmap_park(struct lh_client_conn *conn, struct Request *r) {
+        struct Message *req = &r->msgs[0];
+
+        pthread_mutex_lock(&conn->unmap_mutex);
+        if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) ==
+                        CLIENT_CONN_STATE_CLOSE) {
+                // The unmap thread may be gone already
+                pthread_mutex_unlock(&conn->unmap_mutex);
+                complete_request(conn, req, -EFAULT);
+                return;
+        }
+        if (conn->unmap_pending == NULL) {
+                conn->unmap_first_ns = monotonic_ns();
+                pthread_cond_broadcast(&conn->unmap_cond);
+        }
+        req->send_next = conn->unmap_pending;
+        conn->unmap_pending = req;
+        conn->unmap_nr_pending++;
+        conn->unmap_pending_bytes += req->Size;
+        if (conn->unmap_max_bytes != 0 &&
+                        conn->unmap_pending_bytes >= conn->unmap_max_bytes) {
+                pthread_cond_broadcast(&conn->unmap_cond);
+        }
+        pthread_mutex_unlock(&conn->unmap_mutex);
+}
+
+// Send whatever is parked right away and wait until it went through the
+// scheduler, so that a barrier after it orders after it too
+static void unmap_drain(struct lh_client_conn *conn) {
+        pthread_mutex_lock(&conn->unmap_mutex);
+        conn->unmap_draining++;
+        pthread_cond_broadcast(&conn->unmap_cond);
+        while (conn->unmap_pending != NULL || conn->unmap_flushing) {
+                pthread_cond_wait(&conn->unmap_cond, &conn->unmap_mutex);
+        }
+        conn->unmap_draining--;
+        pthread_mutex_unlock(&conn->unmap_mutex);
+}
+
+// Completes the parked unmaps chained on the run's callback_arg
+static void unmap_run_done(struct Completion *comp, void *arg) {
+        struct Request *run = arg;
+        struct Message *req = run->callback_arg, *next;
+        int rc = comp->rc;
+
+        while (req != NULL) {
+                next = req->send_next;
+                complete_request(run->conn, req, rc);
+                req = next;
+        }
+        request_free(run);
+}
+
+static int unmap_cmp(const void *a, const void *b) {
+        const struct Message *x = *(struct Message * const *)a;
+        const struct Message *y = *(struct Message * const *)b;
+
+        return x->Offset < y->Offset ? -1 : x->Offset > y->Offset;
+}
+
+static int request_build(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t type, uint32_t flags,
+                int throttle, struct Request **out);
+
+static void unmap_send_run(struct lh_client_conn *conn, struct Message *chain,
+                off_t start, uint64_t len) {
+        struct iovec iov = { .iov_base = NULL, .iov_len = len };
+        struct Message *next;
+        struct Request *run;
+        int rc;
+
+        // Each parked unmap was throttled when it came in
+        rc = request_build(conn, &iov, 1, start, TypeUnmap, 0, 0, &run);
+        if (rc < 0) {
+                for (; chain != NULL; chain = next) {
+                        next = chain->send_next;
+                        complete_request(conn, chain, rc);
+                }
+                return;
+        }
+        run->callback_arg = chain;
+        run->comp.done = unmap_run_done;
+        run->comp.done_arg = run;
+        request_submit(run);
+}
+
+static void unmap_flush(struct lh_client_conn *conn, struct Message *list, int n) {
+        struct Message **sorted, *req, *chain = NULL;
+        off_t start = 0, end = 0;
+        int i, runs = 0;
+
+        sorted = malloc(n * sizeof(*sorted));
+        if (sorted == NULL) {
+                // Send them as they are
+                for (; list != NULL; list = req) {
+                        req = list->send_next;
+                        list->send_next = NULL;
+                        unmap_send_run(conn, list, list->Offset, list->Size);
+                }
+                return;
+        }
+        for (i = 0; i < n; i++, list = list->send_next) {
+                sorted[i] = list;
+        }
+        qsort(sorted, n, sizeof(*sorted), unmap_cmp);
+
+        for (i = 0; i < n; i++) {
+                req = sorted[i];
+                if (chain != NULL && req->Offset <= end &&
+                                (uint64_t)(req->Offset + req->Size - start) <= UINT32_MAX) {
+                        if (req->Offset + (off_t)req->Size > end) {
+                                end = req->Offset + req->Size;
+                        }
+                } else {
+                        if (chain != NULL) {
+                                unmap_send_run(conn, chain, start, end - start);
+                                runs++;
+                        }
+                        chain = NULL;
+                        start = req->Offset;
+                        end = req->Offset + req->Size;
+                }
+                req->send_next = chain;
+                chain = req;
+        }
+        unmap_send_run(conn, chain, start, end - start);
+        runs++;
+        free(sorted);
+
+        if (n > runs) {
+                __sync_fetch_and_add(&conn->stats.unmaps_coalesced, n - runs);
+        }
+}
+
+static void *unmap_process(void *arg) {
+        struct lh_client_conn *conn = arg;
+        struct Message *list, *next;
+        struct timespec ts;
+        uint64_t deadline;
+        int n, closing;
+
+        thread_bind_memory(conn);
+
+        pthread_mutex_lock(&conn->unmap_mutex);
+        while (1) {
+                closing = __atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) ==
+                        CLIENT_CONN_STATE_CLOSE;
+                if (conn->unmap_pending == NULL) {
+                        if (closing) {
+                                break;
+                        }
+                        pthread_cond_wait(&conn->unmap_cond, &conn->unmap_mutex);
+                        continue;
+                }
+
+                deadline = conn->unmap_first_ns + conn->unmap_window_ns;
+                if (!closing && !conn->unmap_draining && monotonic_ns() < deadline &&
+                                (conn->unmap_max_bytes == 0 ||
+                                 conn->unmap_pending_bytes < conn->unmap_max_bytes)) {
+                        ts.tv_sec = deadline / 1000000000ULL;
+                        ts.tv_nsec = deadline % 1000000000ULL;
+                        pthread_cond_timedwait(&conn->unmap_cond,
+                                        &conn->unmap_mutex, &ts);
+                        continue;
+                }
+
+                list = conn->unmap_pending;
+                n = conn->unmap_nr_pending;
+                conn->unmap_pending = NULL;
+                conn->unmap_nr_pending = 0;
+                conn->unmap_pending_bytes = 0;
+                conn->unmap_flushing = 1;
+                pthread_mutex_unlock(&conn->unmap_mutex);
+
+                if (closing) {
+                        for (; list != NULL; list = next) {
+                                next = list->send_next;
+                                complete_request(conn, list, -EFAULT);
+                        }
+                } else {
+                        unmap_flush(conn, list, n);
+                }
+                pthread_mutex_lock(&conn->unmap_mutex);
+                conn->unmap_flushing = 0;
+                pthread_cond_broadcast(&conn->unmap_cond);
+        }
+        pthread_mutex_unlock(&conn->unmap_mutex);
+        return NULL;
+}
+
+static int start_process(struct lh_client_conn *conn) {
+        int rc;
+
+        conn->timeout_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (conn->timeout_fd < 0) {
+                LOG_ERROR("Fail to create timerfd");
+                return -EFAULT;
+        }
+        conn->timer_armed = 0;
+        rc = thread_create(conn, &conn->timeout_thread, &timeout_handler, -1);
+        if (rc < 0) {
+                LOG_ERROR("Fail to create response thread");
+                return -EFAULT;
+        }
+        rc = thread_create(conn, &conn->response_thread, &response_process,
+                        conn->response_cpu);
+        if (rc < 0) {
+                LOG_ERROR("Fail to create response thread");
+                return -EFAULT;
+        }
+        if (conn->sender_enabled) {
+                conn->send_stack = NULL;
+                conn->sender_sleeping = 0;
+                rc = thread_create(conn, &conn->sender_thread, &sender_process, -1);
+                if (rc < 0) {
+                        LOG_ERROR("Fail to create sender thread");
+                        return -EFAULT;
+                }
+                conn->sender_running = 1;
+        }
+        if (conn->unmap_window_ns != 0) {
+                conn->unmap_pending = NULL;
+                conn->unmap_nr_pending = 0;
+                conn->unmap_pending_bytes = 0;
+                rc = thread_create(conn, &conn->unmap_thread, &unmap_process, -1);
+                if (rc < 0) {
+                        LOG_ERROR("Fail to create unmap thread");
+                        return -EFAULT;
+                }
+                conn->unmap_running = 1;
+        }
+        return 0;
+}
+
+// Fail fast instead of queueing when the connection asked for it
+static int sched_admit(struct lh_client_conn *conn) {
+        struct Scheduler *sched = &conn->sched;
+        int rc = 0;
+
+        if (!sched->depth_config.nonblock) {
+                return 0;
+        }
+
+        pthread_mutex_lock(&sched->mutex);
+        if (sched->depth != 0 &&
+                        sched->total_inflight + sched->queued >= sched->depth) {
+                rc = -EAGAIN;
+        }
+        pthread_mutex_unlock(&sched->mutex);
+        if (rc < 0) {
+                __sync_fetch_and_add(&conn->stats.queue_full_rejections, 1);
+        }
+        return rc;
+}
+
+// Wait until the request conforms to the connection and group limits
+static void qos_throttle(struct lh_client_conn *conn, uint32_t type, size_t count) {
+        struct QosGroup *group = __atomic_load_n(&conn->qos_group, __ATOMIC_ACQUIRE);
+        uint64_t bytes = type_has_payload(type) ? count : 0;
+        uint64_t now = monotonic_ns();
+        uint64_t delay, group_delay;
+        struct timespec ts;
+
+        delay = qos_limiter_reserve(&conn->qos, bytes, now);
+        if (group != NULL) {
+                group_delay = qos_limiter_reserve(&group->limiter, bytes, now);
+                if (group_delay > delay) {
+                        delay = group_delay;
+                }
+        }
+        if (delay == 0) {
+                return;
+        }
+
+        __sync_fetch_and_add(&conn->stats.throttled_requests, 1);
+        __sync_fetch_and_add(&conn->stats.throttle_delay_us, delay / 1000);
+        ts.tv_sec = delay / 1000000000ULL;
+        ts.tv_nsec = delay % 1000000000ULL;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+}
+
+/*
+ * Reads and writes larger than conn->segment_size are split into segments
+ * which are pipelined on the socket back to back, so other requests can
+ * interleave between them. They all complete through r->comp: its done
+ * callback, if the owner sets one before request_submit(), is called once
+ * every segment finished, otherwise a waiter can wait_completion().
+ *
+ * flags are LH_CLIENT_REQ_*. A barrier is never split, so nothing can
+ * slip in between its segments. Flags only go on the wire when the
+ * replica negotiated them.
+ */
+static int request_build(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t type, uint32_t flags,
+                int throttle, struct Request **out) {
+        struct Request *r;
+        struct Message *req;
+        struct iovec *slices;
+        struct iov_cursor cur = { .iov = iov, .iovcnt = iovcnt };
+        size_t count = iov_length(iov, iovcnt);
+        size_t seg_size = count, len;
+        int nsegs = 1, i;
+
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->state == CLIENT_CONN_STATE_CLOSE) {
+                LOG_ERROR("Cannot queue in more request. Connection is not open");
+                pthread_mutex_unlock(&conn->mutex);
+                return -EFAULT;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (type != TypeRead && type != TypeWrite && type != TypeUnmap &&
+                        type != TypeExtents) {
+                LOG_ERROR("BUG: Invalid type for process_request %d", type);
+                return -EFAULT;
+        }
+
+        if ((type == TypeRead || type == TypeWrite) && conn->segment_size != 0 &&
+                        !(flags & LH_CLIENT_REQ_BARRIER) &&
+                        count > conn->segment_size) {
+                seg_size = conn->segment_size;
+                nsegs = (count + seg_size - 1) / seg_size;
+        }
+        if (seg_size > UINT32_MAX) {
+                LOG_ERROR("Request of %zu bytes is too large", count);
+                return -EINVAL;
+        }
+
+        if (throttle) {
+                qos_throttle(conn, type, count);
+        }
+
+        // Each segment boundary splits at most one iovec in two
+        r = malloc(sizeof(struct Request) + nsegs * sizeof(struct Message) +
+                        (iovcnt + nsegs) * sizeof(struct iovec));
+        if (r == NULL) {
+                LOG_ERROR("cannot allocate memory for req for type %d offset %ld count %zu",
+                                type, offset, count);
+                return -EINVAL;
+        }
+        r->conn = conn;
+        r->nr_msgs = nsegs;
+        r->msgs = (struct Message *)(r + 1);
+        r->callback = NULL;
+        r->callback_arg = NULL;
+        r->refs = 1;
+        r->pinned = 0;
+        slices = (struct iovec *)(r->msgs + nsegs);
+
+        completion_init(&r->comp, nsegs, 0);
+        r->comp.spin_ns = __atomic_load_n(&conn->completion_spin_ns, __ATOMIC_RELAXED);
+        for (i = 0; i < nsegs; i++) {
+                len = count - i * seg_size < seg_size ? count - i * seg_size : seg_size;
+
+                req = &r->msgs[i];
+                req->Seq = new_seq(conn);
+                req->Type = type;
+                req->Offset = offset + i * seg_size;
+                req->Size = len;
+                req->iov = slices;
+                req->iovcnt = iov_cursor_take(&cur, len, slices);
+                req->comp = &r->comp;
+                req->no_replay = 0;
+                req->map = NULL;
+                req->Flags = (conn->features & FeatureRequestFlags) ? flags : 0;
+                req->barrier = !!(flags & LH_CLIENT_REQ_BARRIER);
+                req->prio = thread_prio;
+                req->sched_state = SCHED_STATE_NONE;
+                slices += req->iovcnt;
+
+                // We only going to transfer data on wire if it's write request
+                req->DataLength = 0;
+                if (req->Type == TypeWrite) {
+                        req->DataLength = len;
+                }
+        }
+
+        *out = r;
+        return 0;
+}
+
+int request_alloc_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t type, uint32_t flags,
+                struct Request **out) {
+        return request_build(conn, iov, iovcnt, offset, type, flags, 1, out);
+}
+
+int request_alloc(struct lh_client_conn *conn, const struct iovec *iov, int iovcnt,
+                off_t offset, uint32_t type, struct Request **out) {
+        return request_alloc_flags(conn, iov, iovcnt, offset, type, 0, out);
+}
+
+// Completes r, through its done callback if it has one, even on failure
+void request_submit(struct Request *r) {
+        struct lh_client_conn *conn = r->conn;
+        struct Message *req, *list;
+        int nsegs = r->nr_msgs, i, rc = 0;
+        uint32_t replays;
+
+        if (conn->sender_running) {
+                // The sender's reference, dropped once it unpinned every
+                // segment
+                __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&r->pinned, nsegs, __ATOMIC_RELEASE);
+                for (i = 0; i < nsegs; i++) {
+                        req = &r->msgs[i];
+                        // The send turn only orders the pushes
+                        rc = sched_acquire(conn, req);
+                        if (rc < 0) {
+                                break;
+                        }
+                        sender_push(conn, req);
+                        sched_release(conn);
+                }
+                for (; i < nsegs; i++) {
+                        complete_request(conn, &r->msgs[i], rc);
+                        sender_unpin(&r->msgs[i]);
+                }
+                sender_kick(conn);
+                if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) ==
+                                CLIENT_CONN_STATE_CLOSE) {
+                        // The sender may be gone already
+                        list = __atomic_exchange_n(&conn->send_stack, NULL,
+                                        __ATOMIC_SEQ_CST);
+                        if (list != NULL) {
+                                sender_flush(conn, list);
+                        }
+                }
+                return;
+        }
+
+        for (i = 0; i < nsegs; i++) {
+                req = &r->msgs[i];
+                rc = sched_acquire(conn, req);
+                if (rc < 0) {
+                        break;
+                }
+                rc = add_request_in_queue(conn, req, &replays);
+                if (rc < 0) {
+                        sched_release(conn);
+                        break;
+                }
+                rc = send_request(conn, req, replays);
+                sched_release(conn);
+                if (rc < 0) {
+                        // Fail the segment that didn't make it, unless the
+                        // close path got to it first
+                        if (find_and_remove_request_from_queue(conn, req->Seq) != NULL) {
+                                complete_request(conn, req, rc);
+                        }
+                        i++;
+                        break;
+                }
+        }
+        // Fail the unsent rest
+        for (; rc < 0 && i < nsegs; i++) {
+                complete_request(conn, &r->msgs[i], rc);
+        }
+}
+
+// Returns an error without calling done if nothing could be sent
+int request_start(struct lh_client_conn *conn, const struct iovec *iov, int iovcnt,
+                off_t offset, uint32_t type,
+                void (*done)(struct Completion *comp, void *arg), void *done_arg,
+                struct Request **out) {
+        int rc;
+
+        rc = request_alloc(conn, iov, iovcnt, offset, type, out);
+        if (rc < 0) {
+                return rc;
+        }
+        (*out)->comp.done = done;
+        (*out)->comp.done_arg = done_arg;
+        request_submit(*out);
+        return 0;
+}
+
+// Fail whatever part of r is still waiting for a response
+void request_cancel(struct Request *r) {
+        int i;
+
+        for (i = 0; i < r->nr_msgs; i++) {
+                if (find_and_remove_request_from_queue(r->conn, r->msgs[i].Seq) != NULL) {
+                        __sync_fetch_and_add(&r->conn->cancelled, 1);
+                        complete_request(r->conn, &r->msgs[i], -ECANCELED);
+                }
+        }
+}
+
+/*
+ * The owner is about to return to its caller while r is still in flight,
+ * so its buffers can't be trusted for a replay after reconnect.
+ */
+void request_detach(struct Request *r) {
+        int i;
+
+        pthread_mutex_lock(&r->conn->msg_mutex);
+        for (i = 0; i < r->nr_msgs; i++) {
+                r->msgs[i].no_replay = 1;
+        }
+        pthread_mutex_unlock(&r->conn->msg_mutex);
+}
+
+struct Request *request_get(struct Request *r) {
+        __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+        return r;
+}
+
+// Drops a reference
+void request_free(struct Request *r) {
+        if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                free(r);
+        }
+}
+
+/*
+ * In sender mode request_submit() returns before the payload is out.
+ * Wait until the sender thread no longer reads the caller's buffers.
+ * The caller must hold a reference.
+ */
+void request_wait_sent(struct Request *r) {
+        uint32_t pinned;
+
+        while ((pinned = __atomic_load_n(&r->pinned, __ATOMIC_ACQUIRE)) != 0) {
+                futex_wait(&r->pinned, pinned, NULL);
+        }
+}
+
+// Like request_submit(), but unmaps may be parked to coalesce
+static void submit_request(struct Request *r) {
+        if (r->conn->unmap_running && r->msgs[0].Type == TypeUnmap) {
+                unmap_park(r->conn, r);
+                return;
+        }
+        request_submit(r);
+}
+
+static int process_request(struct lh_client_conn *conn, const struct iovec *iov, int iovcnt,
+                off_t offset, uint32_t type) {
+        struct Request *r;
+        int rc;
+
+        rc = sched_admit(conn);
+        if (rc < 0) {
+                return rc;
+        }
+
+        rc = request_alloc(conn, iov, iovcnt, offset, type, &r);
+        if (rc < 0) {
+                return rc;
+        }
+        submit_request(r);
+        rc = wait_completion(&r->comp);
+        request_free(r);
+        return rc;
+}
+
+static void async_done(struct Completion *comp, void *arg) {
+        struct Request *r = arg;
+        lh_client_callback_fn callback = r->callback;
+        void *callback_arg = r->callback_arg;
+        int rc = comp->rc;
+
+        request_free(r);
+        callback(rc, callback_arg);
+}
+
+static int process_request_async(struct lh_client_conn *conn,
+                const struct iovec *iov, int iovcnt, off_t offset, uint32_t type,
+                uint32_t flags, lh_client_callback_fn callback, void *arg) {
+        struct Request *r;
+        int rc;
+
+        if (callback == NULL ||
+                        (flags & ~(LH_CLIENT_REQ_BARRIER | LH_CLIENT_REQ_FUA)) != 0 ||
+                        ((flags & LH_CLIENT_REQ_FUA) && type != TypeWrite)) {
+                return -EINVAL;
+        }
+        if ((flags & LH_CLIENT_REQ_FUA) && !(conn->features & FeatureRequestFlags)) {
+                return -EOPNOTSUPP;
+        }
+        if ((flags & LH_CLIENT_REQ_BARRIER) && conn->unmap_running &&
+                        on_completion_thread(conn)) {
+                // Draining the parked unmaps may wait on completions
+                return -EDEADLK;
+        }
+
+        rc = sched_admit(conn);
+        if (rc < 0) {
+                return rc;
+        }
+
+        rc = request_alloc_flags(conn, iov, iovcnt, offset, type, flags, &r);
+        if (rc < 0) {
+                return rc;
+        }
+        r->callback = callback;
+        r->callback_arg = arg;
+        r->comp.done = async_done;
+        r->comp.done_arg = r;
+        if ((flags & LH_CLIENT_REQ_BARRIER) && conn->unmap_running) {
+                unmap_drain(conn);
+        }
+        submit_request(r);
+        return 0;
+}
+
+static int extent_cmp(const void *a, const void *b) {
+        const struct lh_client_extent *x = a, *y = b;
+
+        return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int lh_client_read_sparse(struct lh_client_conn *conn, void *buf, size_t count,
+                off_t offset, struct lh_client_extent *extents, int max_extents) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+        struct ExtentMap map = { .extents = extents, .max = max_extents };
+        struct Request *r;
+        int i, nr, rc;
+
+        if (conn == NULL || extents == NULL || max_extents <= 0) {
+                return -EINVAL;
+        }
+
+        rc = sched_admit(conn);
+        if (rc < 0) {
+                return rc;
+        }
+
+        rc = request_alloc(conn, &iov, 1, offset, TypeRead, &r);
+        if (rc < 0) {
+                return rc;
+        }
+        for (i = 0; i < r->nr_msgs; i++) {
+                r->msgs[i].map = &map;
+        }
+        request_submit(r);
+        rc = wait_completion(&r->comp);
+        request_free(r);
+        if (rc < 0) {
+                return rc;
+        }
+
+        // Segments complete in any order, put them back in line and join
+        // extents across segment boundaries
+        qsort(extents, map.nr, sizeof(*extents), extent_cmp);
+        nr = 0;
+        for (i = 0; i < map.nr; i++) {
+                if (nr > 0 && extents[nr - 1].flags == extents[i].flags &&
+                                extents[nr - 1].offset + extents[nr - 1].length ==
+                                extents[i].offset) {
+                        extents[nr - 1].length += extents[i].length;
+                } else {
+                        extents[nr++] = extents[i];
+                }
+        }
+        return map.overflow ? -E2BIG : nr;
+}
+
+// Ask for the extents of up to UINT32_MAX bytes, returns how many came
+static int query_extents(struct lh_client_conn *conn, struct ExtentEntry *table,
+                off_t offset, uint32_t length) {
+        struct iovec iov = {
+                .iov_base = table,
+                .iov_len = MaxExtentEntries * sizeof(struct ExtentEntry),
+        };
+        struct Request *r;
+        int rc;
+
+        rc = sched_admit(conn);
+        if (rc < 0) {
+                return rc;
+        }
+
+        rc = request_alloc(conn, &iov, 1, offset, TypeExtents, &r);
+        if (rc < 0) {
+                return rc;
+        }
+        r->msgs[0].Size = length;
+        request_submit(r);
+        rc = wait_completion(&r->comp);
+        if (rc == 0) {
+                rc = r->msgs[0].result;
+        }
+        request_free(r);
+        return rc;
+}
+
+int lh_client_get_extents(struct lh_client_conn *conn, off_t offset,
+                uint64_t length, struct lh_client_extent *extents, int max_extents) {
+        struct ExtentEntry *table;
+        struct lh_client_extent *last;
+        uint64_t pos = offset, end = offset + length, ext_offset, ext_length;
+        uint32_t flags;
+        int i, got, nr = 0, rc = 0;
+
+        if (conn == NULL || offset < 0 || extents == NULL || max_extents <= 0) {
+                return -EINVAL;
+        }
+        if (length > (uint64_t)(INT64_MAX - offset)) {
+                return -EINVAL;
+        }
+        if (!(conn->features & FeatureExtents)) {
+                return -EOPNOTSUPP;
+        }
+
+        table = malloc(MaxExtentEntries * sizeof(struct ExtentEntry));
+        if (table == NULL) {
+                return -ENOMEM;
+        }
+
+        while (pos < end) {
+                got = query_extents(conn, table, pos,
+                                end - pos < UINT32_MAX ? end - pos : UINT32_MAX);
+                if (got <= 0) {
+                        if (got == 0) {
+                                LOG_ERROR("Empty extent map at %lu", pos);
+                        }
+                        rc = got < 0 ? got : -EIO;
+                        break;
+                }
+
+                for (i = 0; i < got; i++) {
+                        ext_offset = le64toh(table[i].Offset);
+                        ext_length = le32toh(table[i].Length);
+                        flags = le32toh(table[i].Flags) & (ExtentHole | ExtentZero);
+                        if (ext_offset != pos || ext_length == 0 ||
+                                        ext_length > end - pos) {
+                                LOG_ERROR("Extent map doesn't continue at %lu", pos);
+                                rc = -EIO;
+                                goto out;
+                        }
+
+                        last = nr > 0 ? &extents[nr - 1] : NULL;
+                        if (last != NULL && last->flags == flags) {
+                                last->length += ext_length;
+                        } else if (nr < max_extents) {
+                                extents[nr].offset = ext_offset;
+                                extents[nr].length = ext_length;
+                                extents[nr].flags = flags;
+                                nr++;
+                        } else {
+                                goto out;
+                        }
+                        pos += ext_length;
+                }
+        }
+
+out:
+        free(table);
+        return rc < 0 ? rc : nr;
+}
+
+int lh_client_read_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return process_request(conn, &iov, 1, offset, TypeRead);
+}
+
+int lh_client_write_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return process_request(conn, &iov, 1, offset, TypeWrite);
+}
+
+int lh_client_unmap(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
+        struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+        return process_request(conn, &iov, 1, offset, TypeUnmap);
+}
+
+int lh_client_readv_at(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset) {
+        if (iov == NULL || iovcnt <= 0) {
+                return -EINVAL;
+        }
+        return process_request(conn, iov, iovcnt, offset, TypeRead);
+}
+
+int lh_client_writev_at(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset) {
+        if (iov == NULL || iovcnt <= 0) {
+                return -EINVAL;
+        }
+        return process_request(conn, iov, iovcnt, offset, TypeWrite);
+}
+
+int lh_client_open_conn(struct lh_client_conn *conn, char *socket_path) {
+        struct lh_client_backoff backoff;
+        int fd, rc = 0;
+
+        if (conn == NULL) {
+                return -EINVAL;
+        }
+
+        if (strlen(socket_path) >= sizeof(conn->socket_path)) {
+                LOG_ERROR("socket path is too long, more than 108 characters");
+                return -EINVAL;
+        }
+        // The async open passes conn->socket_path itself
+        if (socket_path != conn->socket_path) {
+                strcpy(conn->socket_path, socket_path);
+        }
+
+        backoff = conn->open_backoff;
+        if (backoff.max_attempts == 0) {
+                backoff.max_attempts = retry_counts;
+                backoff.initial_delay_ms = retry_interval * 1000;
+                backoff.max_delay_ms = retry_interval * 1000;
+                backoff.multiplier = 1.0;
+                backoff.jitter_pct = 0;
+        }
+
+        fd = dial_with_backoff(conn, &backoff, NULL);
+        if (fd < 0) {
+                LOG_ERROR("connection error");
+                return -EFAULT;
+        }
+
+        conn->fd = fd;
+        conn->seq = 0;
+        conn->msg_hashtable = NULL;
+        conn->msg_list = NULL;
+        conn->sched.closed = 0;
+
+        rc = negotiate_features(conn, fd);
+        if (rc < 0) {
+                close(fd);
+                return rc;
+        }
+
+        rc = pthread_mutex_init(&conn->mutex, NULL);
+        if (rc < 0) {
+                LOG_ERROR("fail to init conn->mutex");
+                return -EFAULT;
+        }
+
+        rc = pthread_mutex_init(&conn->msg_mutex, NULL);
+        if (rc < 0) {
+                LOG_ERROR("fail to init conn->mutex");
+                return -EFAULT;
+        }
+
+        conn->state = CLIENT_CONN_STATE_OPEN;
+
+        return start_process(conn);
+}
+
+static void *open_process(void *arg) {
+        struct lh_client_conn *conn = arg;
+        uint64_t done = 1;
+
+        thread_bind_memory(conn);
+        conn->open_result = lh_client_open_conn(conn, conn->socket_path);
+        if (write(conn->open_event_fd, &done, sizeof(done)) != sizeof(done)) {
+                LOG_ERROR("Fail to signal open completion");
+        }
+        return NULL;
+}
+
+int lh_client_open_conn_async(struct lh_client_conn *conn, char *socket_path) {
+        int rc;
+
+        if (conn == NULL || socket_path == NULL) {
+                return -EINVAL;
+        }
+        if (strlen(socket_path) >= sizeof(conn->socket_path)) {
+                LOG_ERROR("socket path is too long, more than 108 characters");
+                return -EINVAL;
+        }
+        strcpy(conn->socket_path, socket_path);
+
+        conn->open_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (conn->open_event_fd < 0) {
+                LOG_ERROR("Fail to create open eventfd");
+                return -EFAULT;
+        }
+        conn->open_result = -EINPROGRESS;
+
+        rc = thread_create(conn, &conn->open_thread, &open_process, -1);
+        if (rc != 0) {
+                LOG_ERROR("Fail to create open thread");
+                close(conn->open_event_fd);
+                conn->open_event_fd = -1;
+                return -EFAULT;
+        }
+        return conn->open_event_fd;
+}
+
+int lh_client_open_conn_finish(struct lh_client_conn *conn) {
+        if (conn == NULL || conn->open_event_fd < 0) {
+                return -EINVAL;
+        }
+
+        pthread_join(conn->open_thread, NULL);
+        close(conn->open_event_fd);
+        conn->open_event_fd = -1;
+        return conn->open_result;
+}
+
+int lh_client_set_open_backoff(struct lh_client_conn *conn,
+                const struct lh_client_backoff *backoff) {
+        if (conn == NULL || validate_backoff(backoff) < 0) {
+                return -EINVAL;
+        }
+
+        conn->open_backoff = *backoff;
+        return 0;
+}
 
-                its.it_value.tv_sec += conn->request_timeout;
+int lh_client_set_reconnect_backoff(struct lh_client_conn *conn,
+                const struct lh_client_backoff *backoff) {
+        if (conn == NULL || validate_backoff(backoff) < 0) {
+                return -EINVAL;
+        }
 
-                // Arm
-                if (timerfd_settime(conn->timeout_fd,
-                                TFD_TIMER_ABSTIME,
-                                &its, NULL) < 0) {
-                        LOG_ERROR("BUG: Fail to set new timer");
-                }
-        } else {
-                // When there are no more messages on the queue, we disarm
-                // the timer.  This is because we rearm the timer for every
-                // response received; when there are no more messages on the 
-                // queue, there is no response to be received.
+        conn->reconnect_backoff = *backoff;
+        return 0;
+}
 
-                // Disarm
-                if (timerfd_settime(conn->timeout_fd,
-                                TFD_TIMER_ABSTIME,
-                                &its, NULL) < 0) {
-                        LOG_ERROR("BUG: Fail to disarm timer");
-                }
+int lh_client_set_segment_size(struct lh_client_conn *conn, size_t segment_size) {
+        if (conn == NULL || segment_size > UINT32_MAX) {
+                return -EINVAL;
         }
+
+        conn->segment_size = segment_size;
+        return 0;
 }
 
-void add_request_in_queue(struct lh_client_conn *conn, struct Message *req) {
-        int start_timer = 0;
+int lh_client_set_completion_spin(struct lh_client_conn *conn, int spin_us) {
+        if (conn == NULL || spin_us < 0 || spin_us > 1000000) {
+                return -EINVAL;
+        }
 
-        pthread_mutex_lock(&conn->msg_mutex);
+        __atomic_store_n(&conn->completion_spin_ns, (uint32_t)spin_us * 1000,
+                        __ATOMIC_RELAXED);
+        return 0;
+}
 
-        // Arm timer on this message if there are no other in progress messages.
-        // We start the timer when there are no messages in the queue
-        // This allows us to have a timeout in case the there is only one
-        // message on the queue and we don't receive a response.
-        start_timer = (conn->msg_list == NULL);
+int lh_client_set_busy_poll(struct lh_client_conn *conn, int budget_us) {
+        if (conn == NULL || budget_us < 0 || budget_us > 1000000) {
+                return -EINVAL;
+        }
 
-        HASH_ADD_INT(conn->msg_hashtable, Seq, req);
-        DL_APPEND(conn->msg_list, req);
+        __atomic_store_n(&conn->busy_poll_ns, (uint64_t)budget_us * 1000,
+                        __ATOMIC_RELAXED);
+        return 0;
+}
 
-        if (start_timer) {
-                update_timeout_timer(conn);
+int lh_client_set_features(struct lh_client_conn *conn, uint32_t features) {
+        if (conn == NULL || (features & ~(LH_CLIENT_FEATURE_SPARSE_READ |
+                                        LH_CLIENT_FEATURE_EXTENTS |
+                                        LH_CLIENT_FEATURE_REQUEST_FLAGS)) != 0) {
+                return -EINVAL;
         }
 
-        pthread_mutex_unlock(&conn->msg_mutex);
+        conn->features_wanted = features;
+        return 0;
 }
 
-struct Message *find_and_remove_request_from_queue(struct lh_client_conn *conn,
-                int seq) {
-        struct Message *req = NULL;
-
-        pthread_mutex_lock(&conn->msg_mutex);
-        HASH_FIND_INT(conn->msg_hashtable, &seq, req);
-        if (req != NULL) {
-                HASH_DEL(conn->msg_hashtable, req);
-                DL_DELETE(conn->msg_list, req);
-                // When we find a message on the queue, we will arm the timer
-                // for request_timeout seconds from now.  This ensures
-                // that when messages are on the queue, we should receive some
-                // kind of response to one of the messages on the queue every
-                // request_timeout seconds.
-                //
-                // Also, update_timeout_timer will also disarm the timer when
-                // there are no more messages on the queue because the replica
-                // shouldn't response in this case.
-                update_timeout_timer(conn);
+int lh_client_get_features(struct lh_client_conn *conn) {
+        if (conn == NULL) {
+                return -EINVAL;
         }
-        pthread_mutex_unlock(&conn->msg_mutex);
-        return req;
+        return (int)conn->features;
 }
 
-int lh_client_close_conn(struct lh_client_conn *conn) {
-        struct Message *req, *tmp;
-
+int lh_client_set_sender_thread(struct lh_client_conn *conn, int enable) {
         if (conn == NULL) {
-                return 0;
+                return -EINVAL;
         }
 
-        LOG_INFO("Closing connection");
+        conn->sender_enabled = !!enable;
+        return 0;
+}
 
-        pthread_mutex_lock(&conn->mutex);
-        if  (conn->state == CLIENT_CONN_STATE_CLOSE) {
-                pthread_mutex_unlock(&conn->mutex);
-                return 0;
+int lh_client_set_unmap_coalescing(struct lh_client_conn *conn, int window_us,
+                size_t max_bytes) {
+        if (conn == NULL || window_us < 0) {
+                return -EINVAL;
         }
 
-        // Prevent future requests
-        conn->state = CLIENT_CONN_STATE_CLOSE;
-        close(conn->timeout_fd);
-        close(conn->fd);
-        pthread_mutex_unlock(&conn->mutex);
-
-        pthread_mutex_lock(&conn->msg_mutex);
-        // Clean up and fail all pending requests
-        HASH_ITER(hh, conn->msg_hashtable, req, tmp) {
-                HASH_DEL(conn->msg_hashtable, req);
-                DL_DELETE(conn->msg_list, req);
+        conn->unmap_window_ns = (uint64_t)window_us * 1000;
+        conn->unmap_max_bytes = max_bytes;
+        return 0;
+}
 
-                pthread_mutex_lock(&req->mutex);
-                req->Type = TypeError;
-                LOG_ERROR("Cancel request %d due to disconnection", req->Seq);
-                pthread_mutex_unlock(&req->mutex);
-                pthread_cond_signal(&req->cond);
+int lh_client_set_response_cpu(struct lh_client_conn *conn, int cpu) {
+        if (conn == NULL || cpu < -1 || cpu >= CPU_SETSIZE) {
+                return -EINVAL;
         }
-        pthread_mutex_unlock(&conn->msg_mutex);
 
-        if (pthread_cancel(conn->timeout_thread) < 0) {
-                LOG_ERROR("Cannot cancel timeout thread");
-        }
-        if (pthread_cancel(conn->response_thread) < 0) {
-                LOG_ERROR("Cannot cancel response thread");
-        }
-        if (pthread_join(conn->timeout_thread, NULL) < 0) {
-                LOG_ERROR("Cannot wait for timeout thread");
-        }
-        if (pthread_join(conn->response_thread, NULL) < 0) {
-                LOG_ERROR("Cannot wait for response thread");
-        }
-        LOG_ERROR("Connection close complete");
+        conn->response_cpu = cpu;
         return 0;
 }
 
-void* response_process(void *arg) {
-        struct lh_client_conn *conn = arg;
-        struct Message *req, *resp;
-        int ret = 0;
+// Parse a sysfs cpulist such as "0-3,8-11"
+static int node_cpus(int node, cpu_set_t *set) {
+        char path[64], list[1024], *p, *end;
+        long first, last;
+        FILE *f;
 
-        resp = malloc(sizeof(struct Message));
-        if (resp == NULL) {
-            LOG_ERROR("cannot allocate memory for resp");
-            return NULL;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (f == NULL) {
+                return -ENOENT;
+        }
+        p = fgets(list, sizeof(list), f);
+        fclose(f);
+        if (p == NULL) {
+                return -EINVAL;
         }
 
-        while (1) {
-                ret = receive_response(conn, resp);
-                if (ret != 0) {
-                        break;
-                }
-
-                if (resp->Type == TypeClose) {
-                        LOG_ERROR("Receive close message, about to end the connection");
-                        break;
-                }
-
-                switch (resp->Type) {
-                case TypeRead:
-                case TypeWrite:
-                case TypeUnmap:
-                        LOG_ERROR("Wrong type for response %d of seq %d",
-                                        resp->Type, resp->Seq);
-                        continue;
-                case TypeError:
-                case TypeENOSPC:
-                        LOG_ERROR("Receive error for response %d of seq %d",
-					resp->Type, resp->Seq);
-                        /* fall through so we can response to caller */
-                case TypeEOF:
-                case TypeResponse:
-                        break;
-                default:
-                        LOG_ERROR("Unknown message type %d", resp->Type);
+        CPU_ZERO(set);
+        while (*p != '\0' && *p != '\n') {
+                first = last = strtol(p, &end, 10);
+                if (end == p) {
+                        return -EINVAL;
                 }
-
-                req = find_and_remove_request_from_queue(conn, resp->Seq);
-                if (req == NULL) {
-                        LOG_ERROR("Unknown response sequence %d", resp->Seq);
-                        free(resp->Data);
-                        continue;
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
                 }
-
-                pthread_mutex_lock(&req->mutex);
-
-                if (resp->Type == TypeResponse || resp->Type == TypeEOF) {
-                        req->Size = resp->Size;
-                        req->DataLength = resp->DataLength;
-                        if (resp->DataLength != 0) {
-                                memcpy(req->Data, resp->Data, resp->DataLength);
-                        }
-                } else if (resp->Type == TypeError) {
-                        req->Type = TypeError;
-                } else if (resp->Type == TypeENOSPC) {
-                        req->Type = TypeENOSPC;
+                for (; first <= last && first < CPU_SETSIZE; first++) {
+                        CPU_SET(first, set);
                 }
-
-                free(resp->Data);
-                pthread_mutex_unlock(&req->mutex);
-                pthread_cond_signal(&req->cond);
-        }
-        free(resp);
-        if (ret != 0) {
-                LOG_ERROR("Receive response returned error");
+                p = (*end == ',') ? end + 1 : end;
         }
-        lh_client_close_conn(conn);
-        return NULL;
+        return CPU_COUNT(set) > 0 ? 0 : -EINVAL;
 }
 
-void *timeout_handler(void *arg) {
-        struct lh_client_conn *conn = arg;
-        int ret;
-        int nfds = 1;
-        struct pollfd *fds = malloc(sizeof(struct pollfd) * nfds);
-        struct Message *req;
-        struct timespec now;
+int lh_client_set_affinity(struct lh_client_conn *conn, const int *cpus,
+                int nr_cpus, int numa_node) {
+        cpu_set_t set;
+        int i, rc;
 
-        fds[0].fd = conn->timeout_fd;
-        fds[0].events = POLLIN;
-        fds[0].revents = 0;
+        if (conn == NULL || nr_cpus < 0 || (nr_cpus > 0 && cpus == NULL) ||
+                        numa_node < -1 || numa_node >= 256) {
+                return -EINVAL;
+        }
 
-        while (1) {
-                ret = poll(fds, nfds, -1);
-                if (ret < 0) {
-                        LOG_ERROR("Fail to poll timeout fd");
-                        break;
-                }
-                if (fds[0].revents == POLLHUP) {
-                        LOG_ERROR("Timeout fd closed");
-                        break;
-                }
-                if (ret != 1 || fds[0].revents != POLLIN) {
-                        LOG_ERROR("BUG: Timeout fd polling have unexpected result");
-                        break;
+        CPU_ZERO(&set);
+        for (i = 0; i < nr_cpus; i++) {
+                if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+                        return -EINVAL;
                 }
-
-                if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
-                        LOG_ERROR("BUG: Fail to get current time");
-                        break;
+                CPU_SET(cpus[i], &set);
+        }
+        if (nr_cpus == 0 && numa_node >= 0) {
+                rc = node_cpus(numa_node, &set);
+                if (rc < 0) {
+                        LOG_ERROR("Cannot find the CPUs of node %d", numa_node);
+                        return rc;
                 }
+        }
 
-                pthread_mutex_lock(&conn->msg_mutex);
-                DL_FOREACH(conn->msg_list, req) {
-                        HASH_DEL(conn->msg_hashtable, req);
-                        DL_DELETE(conn->msg_list, req);
+        conn->cpus = set;
+        conn->affinity_set = CPU_COUNT(&set) > 0;
+        conn->numa_node = numa_node;
 
-                        pthread_mutex_lock(&req->mutex);
-                        req->Type = TypeError;
-                        LOG_ERROR("Timeout request %d due to disconnection", req->Seq);
-                        pthread_mutex_unlock(&req->mutex);
-                        pthread_cond_signal(&req->cond);
-                }
-                pthread_mutex_unlock(&conn->msg_mutex);
-        }
-        free(fds);
-	return NULL;
+        pthread_mutex_lock(&conn->buffers.mutex);
+        conn->buffers.numa_node = numa_node;
+        pthread_mutex_unlock(&conn->buffers.mutex);
+        return 0;
 }
 
-int start_process(struct lh_client_conn *conn) {
-        int rc;
-
-        conn->timeout_fd = timerfd_create(CLOCK_MONOTONIC, 0);
-        if (conn->timeout_fd < 0) {
-                LOG_ERROR("Fail to create timerfd");
-                return -EFAULT;
-        }
-        rc = pthread_create(&conn->timeout_thread, NULL, &timeout_handler, conn);
-        if (rc < 0) {
-                LOG_ERROR("Fail to create response thread");
-                return -EFAULT;
-        }
-        rc = pthread_create(&conn->response_thread, NULL, &response_process, conn);
-        if (rc < 0) {
-                LOG_ERROR("Fail to create response thread");
-                return -EFAULT;
+int lh_client_set_buffer_pool(struct lh_client_conn *conn, size_t limit_bytes,
+                int flags) {
+        if (conn == NULL || (flags & ~LH_CLIENT_BUFFER_MLOCK) != 0) {
+                return -EINVAL;
         }
+
+        pthread_mutex_lock(&conn->buffers.mutex);
+        conn->buffers.limit = limit_bytes;
+        conn->buffers.flags = flags;
+        pthread_mutex_unlock(&conn->buffers.mutex);
         return 0;
 }
 
-int new_seq(struct lh_client_conn *conn) {
-        return __sync_fetch_and_add(&conn->seq, 1);
+void *lh_client_alloc_buffer(struct lh_client_conn *conn, size_t size) {
+        if (conn == NULL) {
+                return NULL;
+        }
+        return buffer_pool_alloc(&conn->buffers, size);
 }
 
-int process_request(struct lh_client_conn *conn, void *buf, size_t count, off_t offset,
-                uint32_t type) {
-        struct Message *req = malloc(sizeof(struct Message));
-        int rc = 0;
-
-        pthread_mutex_lock(&conn->mutex);
-        if (conn->state != CLIENT_CONN_STATE_OPEN) {
-                LOG_ERROR("Cannot queue in more request. Connection is not open");
-                pthread_mutex_unlock(&conn->mutex);
-                return -EFAULT;
+void lh_client_free_buffer(struct lh_client_conn *conn, void *buf) {
+        if (conn == NULL) {
+                return;
         }
-        pthread_mutex_unlock(&conn->mutex);
+        buffer_pool_free(&conn->buffers, buf);
+}
 
-        if (req == NULL) {
-                LOG_ERROR("cannot allocate memory for req for type %d offset %ld count %zu",
-                                type, offset, count);
+int lh_client_set_thread_priority(int prio) {
+        if (prio < 0 || prio >= LH_CLIENT_PRIO_CLASSES) {
                 return -EINVAL;
         }
 
-        if (type != TypeRead && type != TypeWrite && type != TypeUnmap) {
-                LOG_ERROR("BUG: Invalid type for process_request %d", type);
-                rc = -EFAULT;
-                goto free;
-        }
-        req->Seq = new_seq(conn);
-        req->Type = type;
-        req->Offset = offset;
-        req->Size = count;
-        req->Data = buf;
-        req->DataLength = 0;
+        thread_prio = prio;
+        return 0;
+}
+
+int lh_client_set_class_limit(struct lh_client_conn *conn, int prio,
+                int max_inflight, int quantum_bytes) {
+        struct Scheduler *sched;
 
-        // We only going to transfer data on wire if it's write request
-        if (req->Type == TypeWrite) {
-                req->DataLength = count;
+        if (conn == NULL || prio < 0 || prio >= LH_CLIENT_PRIO_CLASSES ||
+                        max_inflight < 0 || quantum_bytes < 0) {
+                return -EINVAL;
         }
 
-        rc = pthread_cond_init(&req->cond, NULL);
-        if (rc < 0) {
-                LOG_ERROR("Fail to init pthread_cond");
-                rc = -EFAULT;
-                goto free;
+        sched = &conn->sched;
+        pthread_mutex_lock(&sched->mutex);
+        sched->max_inflight[prio] = max_inflight;
+        if (quantum_bytes > 0) {
+                sched->quantum[prio] = quantum_bytes;
         }
-        rc = pthread_mutex_init(&req->mutex, NULL);
-        if (rc < 0) {
-                LOG_ERROR("Fail to init pthread_mutex");
-                rc = -EFAULT;
-                goto free;
+        if (!sched->busy) {
+                sched_dispatch(sched);
         }
+        pthread_mutex_unlock(&sched->mutex);
+        return 0;
+}
 
-        add_request_in_queue(conn, req);
+int lh_client_set_queue_depth(struct lh_client_conn *conn,
+                const struct lh_client_queue_depth *qd) {
+        struct Scheduler *sched;
 
-        pthread_mutex_lock(&req->mutex);
-        rc = send_request(conn, req);
-        if (rc < 0) {
-                goto out;
+        if (conn == NULL || qd == NULL || qd->max_depth < 0 ||
+                        qd->target_latency_us < 0 ||
+                        (qd->target_latency_us != 0 &&
+                         (qd->min_depth < 1 || qd->min_depth > qd->max_depth))) {
+                return -EINVAL;
         }
 
-        pthread_cond_wait(&req->cond, &req->mutex);
-
-        if (req->Type == TypeError) {
-                rc = -EFAULT;
+        sched = &conn->sched;
+        pthread_mutex_lock(&sched->mutex);
+        sched->depth_config = *qd;
+        sched->depth = qd->max_depth;
+        sched->adaptive_depth = qd->max_depth;
+        if (!sched->busy) {
+                sched_dispatch(sched);
         }
-        if (req->Type == TypeENOSPC) {
-                rc = -ENOSPC;
-        }
-out:
-        pthread_mutex_unlock(&req->mutex);
-        // need to clean up in case send_request() failed
-        find_and_remove_request_from_queue(conn, req->Seq);
-free:
-        free(req);
-        return rc;
-}
-
-int lh_client_read_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
-        return process_request(conn, buf, count, offset, TypeRead);
+        pthread_mutex_unlock(&sched->mutex);
+        return 0;
 }
 
-int lh_client_write_at(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
-        return process_request(conn, buf, count, offset, TypeWrite);
-}
+int lh_client_set_qos(struct lh_client_conn *conn, const struct lh_client_qos *qos) {
+        if (conn == NULL || qos == NULL) {
+                return -EINVAL;
+        }
 
-int lh_client_unmap(struct lh_client_conn *conn, void *buf, size_t count, off_t offset) {
-        return process_request(conn, buf, count, offset, TypeUnmap);
+        qos_limiter_set(&conn->qos, qos);
+        return 0;
 }
 
-int lh_client_open_conn(struct lh_client_conn *conn, char *socket_path) {
-        struct sockaddr_un addr;
-        int fd, rc = 0;
-        int i, connected = 0;
+int lh_client_join_qos_group(struct lh_client_conn *conn, const char *name) {
+        struct QosGroup *group = NULL, *old;
 
         if (conn == NULL) {
                 return -EINVAL;
         }
 
-        fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (fd == -1) {
-                LOG_ERROR("socket error");
-                return -EFAULT;
-        }
-
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        if (strlen(socket_path) >= 108) {
-                LOG_ERROR("socket path is too long, more than 108 characters");
-                return -EINVAL;
-        }
-
-        strncpy(addr.sun_path, socket_path, strlen(socket_path));
-
-        for (i = 0; i < retry_counts; i ++) {
-                if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-                        connected = 1;
-                        break;
-		}
-
-                LOG_ERROR("Cannot connect, retrying");
-                sleep(retry_interval);
+        if (name != NULL) {
+                group = qos_group_get(name);
+                if (group == NULL) {
+                        return -ENOENT;
+                }
         }
-        if (!connected) {
-                LOG_ERROR("connection error");
-                return -EFAULT;
+        old = __atomic_exchange_n(&conn->qos_group, group, __ATOMIC_ACQ_REL);
+        if (old != NULL) {
+                qos_group_put(old);
         }
+        return 0;
+}
 
-        conn->fd = fd;
-        conn->seq = 0;
-        conn->msg_hashtable = NULL;
-        conn->msg_list = NULL;
-
-        rc = pthread_mutex_init(&conn->mutex, NULL);
-        if (rc < 0) {
-                LOG_ERROR("fail to init conn->mutex");
-                return -EFAULT;
-        }
+int lh_client_set_reconnect(struct lh_client_conn *conn, int max_retries,
+                int initial_delay_ms, int max_delay_ms) {
+        struct lh_client_backoff backoff = {
+                .max_attempts = max_retries,
+                .initial_delay_ms = initial_delay_ms,
+                .max_delay_ms = max_delay_ms,
+                .multiplier = 2.0,
+                .jitter_pct = 0,
+        };
+
+        return lh_client_set_reconnect_backoff(conn, &backoff);
+}
 
-        rc = pthread_mutex_init(&conn->msg_mutex, NULL);
-        if (rc < 0) {
-                LOG_ERROR("fail to init conn->mutex");
-                return -EFAULT;
+int lh_client_get_stats(struct lh_client_conn *conn, struct lh_client_stats *stats) {
+        if (conn == NULL || stats == NULL) {
+                return -EINVAL;
         }
 
-        conn->state = CLIENT_CONN_STATE_OPEN;
+        pthread_mutex_lock(&conn->mutex);
+        *stats = conn->stats;
+        pthread_mutex_unlock(&conn->mutex);
 
-        return start_process(conn);
+        pthread_mutex_lock(&conn->sched.mutex);
+        stats->queue_depth = conn->sched.depth;
+        pthread_mutex_unlock(&conn->sched.mutex);
+        return 0;
 }
 
 struct lh_client_conn *lh_client_allocate_conn(int request_timeout) {
         struct lh_client_conn *conn = malloc(sizeof(struct lh_client_conn));
+        pthread_condattr_t attr;
+
         if (conn == NULL) {
                 return NULL;
         }
         bzero(conn, sizeof(struct lh_client_conn));
 
-        conn->header_size = sizeof(struct MessageHeader);
+        conn->header_size = MAX_HEADER_SIZE;
         conn->request_header = malloc(conn->header_size);
-        conn->response_header = malloc(conn->header_size);
-        if (!conn->request_header || !conn->response_header) {
-                free(conn->request_header);
-                free(conn->response_header);
+        if (!conn->request_header) {
                 free(conn);
                 return NULL;
         }
 
         conn->request_timeout = request_timeout;
+        conn->segment_size = DEFAULT_SEGMENT_SIZE;
+        sched_init(&conn->sched);
+        pthread_mutex_init(&conn->unmap_mutex, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&conn->unmap_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        conn->open_event_fd = -1;
+        conn->response_cpu = -1;
+        conn->numa_node = -1;
+        buffer_pool_init(&conn->buffers);
+        conn->backoff_seed = (unsigned int)monotonic_ns() ^ (uintptr_t)conn;
 
         return conn;
 }
 
 void lh_client_free_conn(struct lh_client_conn *conn) {
         if (conn) {
+                if (conn->response_closed) {
+                        // Still returning from lh_client_close_conn()
+                        pthread_join(conn->response_thread, NULL);
+                }
+                lh_client_join_qos_group(conn, NULL);
+                buffer_pool_destroy(&conn->buffers);
                 free(conn->request_header);
-                free(conn->response_header);
                 free(conn);
         }
 }
+
+int lh_client_readv_async(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, lh_client_callback_fn callback, void *arg) {
+        return process_request_async(conn, iov, iovcnt, offset, TypeRead, 0,
+                        callback, arg);
+}
+
+int lh_client_writev_async(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, lh_client_callback_fn callback, void *arg) {
+        return process_request_async(conn, iov, iovcnt, offset, TypeWrite, 0,
+                        callback, arg);
+}
+
+int lh_client_unmap_async(struct lh_client_conn *conn, size_t count, off_t offset,
+                lh_client_callback_fn callback, void *arg) {
+        struct iovec iov = { .iov_base = NULL, .iov_len = count };
+
+        return process_request_async(conn, &iov, 1, offset, TypeUnmap, 0,
+                        callback, arg);
+}
+
+int lh_client_readv_async_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t flags,
+                lh_client_callback_fn callback, void *arg) {
+        return process_request_async(conn, iov, iovcnt, offset, TypeRead, flags,
+                        callback, arg);
+}
+
+int lh_client_writev_async_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t flags,
+                lh_client_callback_fn callback, void *arg) {
+        return process_request_async(conn, iov, iovcnt, offset, TypeWrite, flags,
+                        callback, arg);
+}
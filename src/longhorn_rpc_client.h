@@ -2,8 +2,99 @@
 #define LONGHORN_RPC_CLIENT_HEADER
 
 #include <pthread.h>
+#include <sched.h>
+#include <sys/un.h>
 
+#include "liblonghorn.h"
 #include "longhorn_rpc_protocol.h"
+#include "longhorn_qos.h"
+#include "longhorn_buffer_pool.h"
+
+/*
+ * Tracks a group of messages, or of requests for the replica set. rc holds
+ * the first error seen. A waiter is woken once pending drops to zero, or
+ * once the outcome is decided when only `needed` successes are required.
+ * All fields are updated with atomics, state doubles as the futex word.
+ */
+struct Completion {
+        uint32_t        state;
+        int             pending;
+        int             rc;
+        int             needed;    // 0 waits for everything
+        int             succeeded;
+        int             failed;
+        uint32_t        spin_ns;   // poll this long before sleeping
+
+        // Called instead of waking a waiter once pending drops to zero.
+        // The callback owns the completion from then on and may free it.
+        void            (*done)(struct Completion *comp, void *arg);
+        void            *done_arg;
+};
+
+#define COMPLETION_DONE   (1U << 0)
+#define COMPLETION_WAITER (1U << 1)
+
+/*
+ * One caller request on one connection, carved into nr_msgs messages that
+ * share comp. Allocated as a single block with the iovec slices, freed
+ * with its last reference.
+ */
+struct Request {
+        struct lh_client_conn *conn;
+        struct Completion comp;
+        int             nr_msgs;
+        struct Message  *msgs;
+        int             refs;
+        // Segments the sender thread may still read the payload of, see
+        // request_wait_sent(). The sender holds a reference meanwhile.
+        uint32_t        pinned;
+
+        // For the lh_client_*_async() calls
+        lh_client_callback_fn callback;
+        void            *callback_arg;
+};
+
+/*
+ * Deficit round-robin between priority classes. A submitter needs a send
+ * turn before it writes to the socket; turns are handed out one at a time
+ * and only to classes below their in-flight limit.
+ */
+struct Scheduler {
+        pthread_mutex_t mutex;
+        pthread_cond_t  cond;
+        int             busy;     // a send turn is handed out
+        int             waiters;
+        int             barrier;  // a barrier waits or is in flight
+        int             closed;   // the connection closed, waiters give up
+        int             current;  // class the round-robin pointer is at
+        struct Message  *queue[LH_CLIENT_PRIO_CLASSES];
+        int64_t         deficit[LH_CLIENT_PRIO_CLASSES];
+        int             quantum[LH_CLIENT_PRIO_CLASSES];
+        int             inflight[LH_CLIENT_PRIO_CLASSES];
+        int             max_inflight[LH_CLIENT_PRIO_CLASSES]; // 0 unlimited
+
+        // Connection wide queue depth, see lh_client_set_queue_depth()
+        int             total_inflight;
+        int             queued;
+        int             depth;    // current limit, 0 unlimited
+        struct lh_client_queue_depth depth_config;
+        double          adaptive_depth;
+        uint64_t        last_decrease_ns;
+};
+
+// Extents reported by a read, filled in by the response thread
+struct ExtentMap {
+        struct lh_client_extent *extents;
+        int max;
+        int nr;
+        int overflow;
+};
+
+enum {
+        SCHED_STATE_NONE = 0,
+        SCHED_STATE_QUEUED,
+        SCHED_STATE_INFLIGHT,
+};
 
 struct lh_client_conn {
         int seq;  // must be atomic
@@ -15,21 +106,116 @@ struct lh_client_conn {
 
         pthread_t response_thread;
         pthread_t timeout_thread;
+        // Closed by the response thread itself, which is then joined by
+        // lh_client_free_conn()
+        int response_closed;
 
         struct Message *msg_hashtable;
         struct Message *msg_list;
         pthread_mutex_t msg_mutex;
+        int cancelled; // responses still due for cancelled requests
+        // Lazy request timeout, protected by msg_mutex
+        uint64_t last_progress_ns;
+        int timer_armed;
 
         uint8_t *request_header;
-        uint8_t *response_header;
         int header_size;
 
         int request_timeout; // seconds
+        size_t segment_size; // split larger reads and writes, 0 disables
+
+        char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+        // Zero max_attempts means the retry_counts/retry_interval defaults
+        struct lh_client_backoff open_backoff;
+        // Reconnect mode, disabled when max_attempts is 0
+        struct lh_client_backoff reconnect_backoff;
+        // Bumped with msg_mutex and mutex held whenever the queue is
+        // replayed on a new socket
+        uint32_t replays;
+        unsigned int backoff_seed;
+
+        pthread_t open_thread;
+        int open_event_fd;
+        int open_result;
+
+        struct Scheduler sched;
+
+        struct QosLimiter qos;
+        struct QosGroup *qos_group;
+
+        uint32_t completion_spin_ns;
+        uint64_t busy_poll_ns;  // response thread spin budget
+        int response_cpu;       // -1 leaves it to the scheduler
+
+        // Where the connection threads run and allocate, see
+        // lh_client_set_affinity()
+        cpu_set_t cpus;
+        int affinity_set;
+        int numa_node;
+
+        struct BufferPool buffers;
+
+        // Protocol extensions asked for and accepted, see
+        // lh_client_set_features()
+        uint32_t features_wanted;
+        uint32_t features;
+        // A negotiation on the current socket timed out, its answer may
+        // still come
+        int features_late;
+        uint32_t features_late_seq;
+
+        // Sender thread mode, see lh_client_set_sender_thread()
+        int sender_enabled;     // applied when the connection is opened
+        int sender_running;
+        pthread_t sender_thread;
+        struct Message *send_stack; // lock-free, newest first
+        uint32_t sender_sleeping;
+
+        // Unmap coalescing, see lh_client_set_unmap_coalescing()
+        uint64_t unmap_window_ns;       // applied when the connection is opened
+        uint64_t unmap_max_bytes;
+        int unmap_running;
+        pthread_t unmap_thread;
+        pthread_mutex_t unmap_mutex;
+        pthread_cond_t unmap_cond;      // CLOCK_MONOTONIC
+        struct Message *unmap_pending;  // through send_next, newest first
+        int unmap_nr_pending;
+        uint64_t unmap_pending_bytes;
+        uint64_t unmap_first_ns;        // arrival of the oldest pending
+        int unmap_flushing;             // a taken batch is being sent
+        int unmap_draining;             // barriers waiting for a flush
+
+        struct lh_client_stats stats; // protected by mutex
 };
 
 enum {
         CLIENT_CONN_STATE_OPEN = 0,
         CLIENT_CONN_STATE_CLOSE,
+        CLIENT_CONN_STATE_RECONNECTING,
 };
 
+uint64_t monotonic_ns(void);
+
+void completion_init(struct Completion *comp, int pending, int needed);
+void completion_done(struct Completion *comp, int rc);
+int wait_completion(struct Completion *comp);
+int wait_completion_until(struct Completion *comp, uint64_t deadline_ns);
+
+int request_alloc(struct lh_client_conn *conn, const struct iovec *iov, int iovcnt,
+                off_t offset, uint32_t type, struct Request **out);
+int request_alloc_flags(struct lh_client_conn *conn, const struct iovec *iov,
+                int iovcnt, off_t offset, uint32_t type, uint32_t flags,
+                struct Request **out);
+void request_submit(struct Request *r);
+int request_start(struct lh_client_conn *conn, const struct iovec *iov, int iovcnt,
+                off_t offset, uint32_t type,
+                void (*done)(struct Completion *comp, void *arg), void *done_arg,
+                struct Request **out);
+void request_cancel(struct Request *r);
+void request_detach(struct Request *r);
+struct Request *request_get(struct Request *r);
+void request_wait_sent(struct Request *r);
+void request_free(struct Request *r);
+
 #endif
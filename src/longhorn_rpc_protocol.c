@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "log.h"
 #include "longhorn_rpc_protocol.h"
@@ -26,83 +30,251 @@ static ssize_t read_full(int fd, void *buf, ssize_t len) {
         return nread;
 }
 
-static ssize_t write_full(int fd, void *buf, ssize_t len) {
-        ssize_t nwrote = 0;
-        ssize_t ret;
-
-        while (nwrote < len) {
-                ret = write(fd, buf + nwrote, len - nwrote);
+// Batch size for the iovec copies below, must not exceed IOV_MAX
+#define IOV_BATCH 64
+
+/*
+ * Transfer the whole iovec array, restarting after short transfers.
+ * Returns the number of bytes transferred, which is short only on EOF.
+ */
+static ssize_t transfer_iov_full(int fd, const struct iovec *iov, int iovcnt,
+                int is_write) {
+        struct iovec batch[IOV_BATCH];
+        struct msghdr mh;
+        ssize_t total = 0, ret;
+        size_t skip = 0;
+        int i, n;
+
+        while (iovcnt > 0) {
+                n = iovcnt < IOV_BATCH ? iovcnt : IOV_BATCH;
+                for (i = 0; i < n; i++) {
+                        batch[i] = iov[i];
+                }
+                batch[0].iov_base = (uint8_t *)batch[0].iov_base + skip;
+                batch[0].iov_len -= skip;
+
+                if (is_write) {
+                        memset(&mh, 0, sizeof(mh));
+                        mh.msg_iov = batch;
+                        mh.msg_iovlen = n;
+                        // MSG_NOSIGNAL: a dead replica must surface as EPIPE
+                        // rather than kill the process, so the caller can
+                        // reconnect.
+                        ret = sendmsg(fd, &mh, MSG_NOSIGNAL);
+                } else {
+                        ret = readv(fd, batch, n);
+                }
                 if (ret < 0) {
                         if (errno == EINTR) {
                                 continue;
                         }
                         return ret;
+                } else if (ret == 0 && !is_write) {
+                        return total;
+                }
+                total += ret;
+
+                ret += skip;
+                while (iovcnt > 0 && (size_t)ret >= iov[0].iov_len) {
+                        ret -= iov[0].iov_len;
+                        iov++;
+                        iovcnt--;
                 }
-                nwrote += ret;
+                skip = ret;
         }
 
-        return nwrote;
+        return total;
 }
 
-static int write_header(int fd, struct Message *msg, uint8_t *header) {
-        uint16_t MagicVersion = htole16(msg->MagicVersion);
-	uint32_t Seq = htole32(msg->Seq);
-	uint32_t Type = htole32(msg->Type);
-	uint64_t Offset = htole64(*((uint64_t *)(&msg->Offset)));
-	uint32_t Size = htole32(msg->Size);
-	uint32_t DataLength = htole32(msg->DataLength);
-
-        int offset = 0;
-
-        memcpy(header, &MagicVersion, sizeof(MagicVersion));
-        offset += sizeof(MagicVersion);
+/*
+ * The wire header is struct MessageHeader in little-endian order, so on
+ * little-endian hosts encoding and decoding are a single unaligned copy of
+ * the whole header; the byte swaps compile away and only big-endian hosts
+ * pay for them.
+ */
+static inline int write_header(struct Message *msg, uint8_t *header) {
+        struct MessageHeaderFlags hdr = {
+                .Header = {
+                        .Seq            = htole32(msg->Seq),
+                        .Type           = htole32(msg->Type),
+                        .Offset         = htole64((uint64_t)msg->Offset),
+                        .Size           = htole32(msg->Size),
+                        .DataLength     = htole32(msg->DataLength),
+                },
+                .Flags = htole32(msg->Flags),
+        };
+
+        msg->MagicVersion = msg->Flags != 0 ? MAGIC_VERSION_FLAGS : MAGIC_VERSION;
+        hdr.Header.MagicVersion = htole16(msg->MagicVersion);
+        if (msg->Flags != 0) {
+                memcpy(header, &hdr, sizeof(hdr));
+                return sizeof(hdr);
+        }
+        memcpy(header, &hdr.Header, sizeof(hdr.Header));
+        return sizeof(hdr.Header);
+}
 
-        memcpy(header + offset, &Seq, sizeof(Seq));
-        offset += sizeof(Seq);
+static inline int decode_header(const uint8_t *header, struct Message *msg) {
+        struct MessageHeader hdr;
 
-        memcpy(header + offset, &Type, sizeof(Type));
-        offset += sizeof(Type);
+        memcpy(&hdr, header, sizeof(hdr));
 
-        memcpy(header + offset, &Offset, sizeof(Offset));
-        offset += sizeof(Offset);
+        msg->MagicVersion = le16toh(hdr.MagicVersion);
+        if (msg->MagicVersion != MAGIC_VERSION) {
+                LOG_ERROR("wrong magic version 0x%x, expected 0x%x",
+                                msg->MagicVersion, MAGIC_VERSION);
+                return -EINVAL;
+        }
+        msg->Seq = le32toh(hdr.Seq);
+        msg->Type = le32toh(hdr.Type);
+        msg->Offset = (int64_t)le64toh(hdr.Offset);
+        msg->Size = le32toh(hdr.Size);
+        msg->DataLength = le32toh(hdr.DataLength);
 
-        memcpy(header + offset, &Size, sizeof(Size));
-        offset += sizeof(Size);
+        return sizeof(hdr);
+}
 
-        memcpy(header + offset, &DataLength, sizeof(DataLength));
-        offset += sizeof(DataLength);
+/*
+ * Decode the messages lying back to back in buf, each header followed by
+ * its payload. data_at[i] is the offset of the payload of msgs[i] in buf.
+ * Decoding stops after max messages, at a truncated header, or after a
+ * message whose payload runs past the end of buf; that last message is
+ * still returned, callers check data_at[i] + DataLength against len.
+ */
+int decode_msg_headers(const uint8_t *buf, size_t len, struct Message *msgs,
+                size_t *data_at, int max) {
+        size_t pos = 0;
+        int n = 0;
+
+        while (n < max && len - pos >= sizeof(struct MessageHeader)) {
+                memset(&msgs[n], 0, sizeof(struct Message));
+                if (decode_header(buf + pos, &msgs[n]) < 0) {
+                        return -EINVAL;
+                }
+                pos += sizeof(struct MessageHeader);
+                data_at[n] = pos;
+                if (len - pos < msgs[n].DataLength) {
+                        return n + 1;
+                }
+                pos += msgs[n].DataLength;
+                n++;
+        }
 
-        return write_full(fd, header, offset);
+        return n;
 }
 
+/*
+ * The header and the payload described by msg->iov are gathered into the
+ * same socket write, so the payload is never copied in user space. header
+ * needs room for MAX_HEADER_SIZE bytes.
+ */
 int send_msg(int fd, struct Message *msg, uint8_t *header, int header_size) {
-        ssize_t n = 0;
-
-        msg->MagicVersion = MAGIC_VERSION;
-
-        n = write_header(fd, msg, header);
-        if (n != header_size) {
+        struct iovec iov[IOV_BATCH];
+        uint32_t data_length = msg->DataLength;
+        ssize_t n = 0, expected;
+        int i, iovcnt = 1;
+
+        // The response may arrive as soon as the header is out, so msg
+        // must not be looked at after the first write.
+        if (header_size < (int)MAX_HEADER_SIZE) {
                 LOG_ERROR("fail to write header");
                 return -EINVAL;
         }
+        iov[0].iov_base = header;
+        iov[0].iov_len = write_header(msg, header);
+        header_size = iov[0].iov_len;
+        expected = header_size + data_length;
+
+        if (data_length != 0 && msg->iovcnt < IOV_BATCH) {
+                for (i = 0; i < msg->iovcnt; i++) {
+                        iov[iovcnt++] = msg->iov[i];
+                }
+                n = transfer_iov_full(fd, iov, iovcnt, 1);
+        } else if (data_length != 0) {
+                struct iovec *data_iov = msg->iov;
+                int data_iovcnt = msg->iovcnt;
+
+                n = transfer_iov_full(fd, iov, iovcnt, 1);
+                if (n == header_size) {
+                        n += transfer_iov_full(fd, data_iov, data_iovcnt, 1);
+                }
+        } else {
+                n = transfer_iov_full(fd, iov, iovcnt, 1);
+        }
+        if (n != expected) {
+                if (n < 0)
+                        LOG_ERROR("fail writing data");
+
+                LOG_ERROR("fail to write message, wrote %zd; expected %zd",
+                                n, expected);
+                return -EINVAL;
+        }
+        return 0;
+}
 
-	if (msg->DataLength != 0) {
-		n = write_full(fd, msg->Data, msg->DataLength);
-		if (n != msg->DataLength) {
-                        if (n < 0)
-                                LOG_ERROR("fail writing data");
+// Room for the gathered headers and payloads of a send_msgs() write
+#define SEND_IOV 256
+
+/*
+ * Write n messages back to back, gathering their headers and payloads
+ * into as few socket writes as possible. headers needs room for n
+ * headers of MAX_HEADER_SIZE. As with send_msg(), a message must not be
+ * looked at once its bytes are out, so each one is encoded just before
+ * it is queued up.
+ */
+int send_msgs(int fd, struct Message **msgs, int n, uint8_t *headers) {
+        struct iovec iov[SEND_IOV];
+        struct Message *msg;
+        uint8_t *header;
+        ssize_t expected = 0, ret;
+        int i, j, data_iovcnt, iovcnt = 0, rc;
+
+        for (i = 0; i < n; i++) {
+                msg = msgs[i];
+                header = headers + i * MAX_HEADER_SIZE;
+                data_iovcnt = msg->DataLength != 0 ? msg->iovcnt : 0;
+
+                if (iovcnt + 1 + data_iovcnt > SEND_IOV && iovcnt > 0) {
+                        ret = transfer_iov_full(fd, iov, iovcnt, 1);
+                        if (ret != expected) {
+                                LOG_ERROR("fail to write messages, wrote %zd; expected %zd",
+                                                ret, expected);
+                                return -EINVAL;
+                        }
+                        iovcnt = 0;
+                        expected = 0;
+                }
+                if (1 + data_iovcnt > SEND_IOV) {
+                        rc = send_msg(fd, msg, header, MAX_HEADER_SIZE);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        continue;
+                }
+
+                expected += msg->DataLength;
+                iov[iovcnt].iov_base = header;
+                iov[iovcnt].iov_len = write_header(msg, header);
+                expected += iov[iovcnt].iov_len;
+                iovcnt++;
+                for (j = 0; j < data_iovcnt; j++) {
+                        iov[iovcnt++] = msg->iov[j];
+                }
+        }
 
-			LOG_ERROR("fail to write data, wrote %zd; expected %u",
-                                        n, msg->DataLength);
+        if (iovcnt > 0) {
+                ret = transfer_iov_full(fd, iov, iovcnt, 1);
+                if (ret != expected) {
+                        LOG_ERROR("fail to write messages, wrote %zd; expected %zd",
+                                        ret, expected);
                         return -EINVAL;
-		}
-	}
+                }
+        }
         return 0;
 }
 
 static int read_header(int fd, struct Message *msg, uint8_t *header, int header_size) {
-        uint64_t Offset;
-        int offset = 0, n = 0;
+        int n;
 
         n = read_full(fd, header, header_size);
         if (n != header_size) {
@@ -110,36 +282,11 @@ static int read_header(int fd, struct Message *msg, uint8_t *header, int header_
 		return -EINVAL;
         }
 
-        msg->MagicVersion = le16toh(*((uint16_t *)(header)));
-        offset += sizeof(msg->MagicVersion);
-
-        if (msg->MagicVersion != MAGIC_VERSION) {
-                LOG_ERROR("wrong magic version 0x%x, expected 0x%x",
-                                msg->MagicVersion, MAGIC_VERSION);
-                return -EINVAL;
-        }
-
-        msg->Seq = le32toh(*((uint32_t *)(header + offset)));
-        offset += sizeof(msg->Seq);
-
-        msg->Type = le32toh(*((uint32_t *)(header + offset)));
-        offset += sizeof(msg->Type);
-
-        Offset = le64toh(*((uint64_t *)(header + offset)));
-        msg->Offset = *( (int64_t *) &Offset);
-        offset += sizeof(msg->Offset);
-
-        msg->Size = le32toh(*((uint32_t *)(header + offset)));
-        offset += sizeof(msg->Size);
-
-        msg->DataLength = le32toh(*((uint32_t *)(header + offset)));
-        offset += sizeof(msg->DataLength);
-
-        return offset;
+        return decode_header(header, msg);
 }
 
-// Caller needs to release msg->Data
-int receive_msg(int fd, struct Message *msg, uint8_t *header, int header_size) {
+int receive_msg_header(int fd, struct Message *msg, uint8_t *header,
+                int header_size) {
 	ssize_t n;
 
         bzero(msg, sizeof(struct Message));
@@ -151,20 +298,93 @@ int receive_msg(int fd, struct Message *msg, uint8_t *header, int header_size) {
                 LOG_ERROR("fail to read header");
                 return -EINVAL;
         }
+        return 0;
+}
+
+// Scatter exactly len bytes of payload from the socket into iov
+int receive_msg_data(int fd, const struct iovec *iov, int iovcnt, uint32_t len) {
+        ssize_t n;
+
+        n = transfer_iov_full(fd, iov, iovcnt, 0);
+        if (n != len) {
+                LOG_ERROR("Cannot read full from fd, %u vs %zd", len, n);
+                return -EINVAL;
+        }
+        return 0;
+}
 
-	if (msg->DataLength > 0) {
-		msg->Data = malloc(msg->DataLength);
-                if (msg->Data == NULL) {
-                        LOG_ERROR("cannot allocate memory for data");
+int discard_msg_data(int fd, uint32_t len) {
+        uint8_t scratch[4096];
+        ssize_t n;
+
+        while (len > 0) {
+                n = read_full(fd, scratch, len < sizeof(scratch) ? len : sizeof(scratch));
+                if (n <= 0) {
+                        LOG_ERROR("Cannot discard data from fd");
                         return -EINVAL;
                 }
-		n = read_full(fd, msg->Data, msg->DataLength);
-		if (n != msg->DataLength) {
-                        LOG_ERROR("Cannot read full from fd, %u vs %zd",
-                                msg->DataLength, n);
-			free(msg->Data);
-			return -EINVAL;
-		}
-	}
-	return 0;
+                len -= n;
+        }
+        return 0;
+}
+
+int recv_buffer_init(struct RecvBuffer *rb, size_t size) {
+        rb->data = malloc(size);
+        if (rb->data == NULL) {
+                return -ENOMEM;
+        }
+        rb->size = size;
+        rb->start = 0;
+        rb->end = 0;
+        return 0;
+}
+
+/*
+ * Read as much as the socket has ready into the free space of rb, waiting
+ * only if it has nothing. The unconsumed tail is moved to the front first;
+ * callers drain every complete message before refilling, so it is at most
+ * a partial header.
+ */
+int recv_buffer_fill(int fd, struct RecvBuffer *rb) {
+        ssize_t n;
+
+        if (rb->start > 0) {
+                memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+                rb->end -= rb->start;
+                rb->start = 0;
+        }
+
+        do {
+                n = read(fd, rb->data + rb->end, rb->size - rb->end);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+                LOG_ERROR("fail to read from fd");
+                return -EINVAL;
+        }
+        rb->end += n;
+        return 0;
+}
+
+// Copy up to len unconsumed bytes out of rb, returns how many were copied
+size_t recv_buffer_take(struct RecvBuffer *rb, void *dst, size_t len) {
+        size_t avail = rb->end - rb->start;
+
+        if (len > avail) {
+                len = avail;
+        }
+        memcpy(dst, rb->data + rb->start, len);
+        rb->start += len;
+        return len;
+}
+
+// Skip len bytes of the stream, from rb first and then from the socket
+int recv_buffer_discard(int fd, struct RecvBuffer *rb, uint32_t len) {
+        size_t avail = rb->end - rb->start;
+
+        if (len <= avail) {
+                rb->start += len;
+                return 0;
+        }
+        rb->start = rb->end;
+        return discard_msg_data(fd, len - avail);
 }
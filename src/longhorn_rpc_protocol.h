@@ -3,11 +3,16 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <sys/uio.h>
 
 #include "uthash.h"
 #include "utlist.h"
 
 #define MAGIC_VERSION 0x1b01 // LongHorn01
+#define MAGIC_VERSION_FLAGS 0x1b02 // request header with Flags
+
+struct Completion;
+struct ExtentMap;
 
 struct MessageHeader {
         uint16_t        MagicVersion;
@@ -18,6 +23,24 @@ struct MessageHeader {
         uint32_t        DataLength;
 } __attribute__((packed));
 
+_Static_assert(sizeof(struct MessageHeader) == 26, "wire header is 26 bytes");
+
+/*
+ * With FeatureRequestFlags, requests that carry flags are sent with
+ * MAGIC_VERSION_FLAGS and Flags after the plain header. Responses always
+ * use the plain header.
+ */
+struct MessageHeaderFlags {
+        struct MessageHeader Header;
+        uint32_t        Flags;
+} __attribute__((packed));
+
+// Room for any request header
+#define MAX_HEADER_SIZE sizeof(struct MessageHeaderFlags)
+
+#define RequestBarrier  (1 << 0) // earlier requests completed first
+#define RequestFUA      (1 << 1) // stable once answered
+
 struct Message {
         uint16_t        MagicVersion;
         uint32_t        Seq;
@@ -25,10 +48,30 @@ struct Message {
         int64_t         Offset;
         uint32_t        Size;
         uint32_t        DataLength;
-        void*           Data;
+        uint32_t        Flags;  // sent when nonzero
+        // Payload buffers: the data sent for writes, the destination for
+        // read responses
+        struct iovec    *iov;
+        int             iovcnt;
 
-	pthread_cond_t  cond;
-	pthread_mutex_t mutex;
+        struct Completion *comp;
+        // Where a read reports its extents, NULL if nobody asked
+        struct ExtentMap *map;
+        // Owner returned already, buffers may be gone: fail, don't replay
+        int             no_replay;
+        // Ordered against every other request by the scheduler
+        int             barrier;
+        // What a control request got back, Size stays the one asked for
+        uint32_t        result;
+
+        // Submission scheduler state, see longhorn_rpc_client.c
+        int             prio;
+        int             sched_state;
+        uint64_t        sched_cost;
+        uint64_t        send_ns;
+        struct Message  *sched_next, *sched_prev;
+        // Link on the sender thread's submission stack
+        struct Message  *send_next;
 
         UT_hash_handle  hh;
 
@@ -44,10 +87,65 @@ enum uint32_t {
 	TypeClose,
 	TypePing,
 	TypeUnmap,
-	TypeENOSPC
+	TypeENOSPC,
+	TypeFeatures,
+	TypeSparseResponse,
+	TypeExtents
+};
+
+/*
+ * Protocol extensions. A TypeFeatures request carries the ones the client
+ * wants in Size and the replica answers with the subset it supports.
+ */
+#define FeatureSparseRead       (1 << 0)
+#define FeatureExtents          (1 << 1)
+#define FeatureRequestFlags     (1 << 2)
+
+/*
+ * With FeatureSparseRead a read may be answered by TypeSparseResponse:
+ * Size extent entries covering the read range in order, followed by the
+ * bytes of the data extents only. Holes and zero extents carry no bytes.
+ */
+struct ExtentEntry {
+        uint64_t        Offset;
+        uint32_t        Length;
+        uint32_t        Flags;
+} __attribute__((packed));
+
+#define ExtentHole      (1 << 0) // unallocated, reads as zeros
+#define ExtentZero      (1 << 1) // allocated, known to be zeros
+
+/*
+ * With FeatureExtents a TypeExtents request asks for the allocation map of
+ * Size bytes from Offset. The TypeResponse carries Size extent entries,
+ * at most MaxExtentEntries, covering the start of the range in order; a
+ * reply that stops short leaves the rest to another request.
+ */
+#define MaxExtentEntries        256
+
+/*
+ * Receive side staging buffer. The response thread reads whatever the
+ * socket has into it and parses every complete message in place, bytes
+ * between start and end are not consumed yet.
+ */
+struct RecvBuffer {
+        uint8_t         *data;
+        size_t          size;
+        size_t          start;
+        size_t          end;
 };
 
 int send_msg(int fd, struct Message *msg, uint8_t *header, int header_size);
-int receive_msg(int fd, struct Message *msg, uint8_t *header, int header_size);
+int send_msgs(int fd, struct Message **msgs, int n, uint8_t *headers);
+int receive_msg_header(int fd, struct Message *msg, uint8_t *header,
+                int header_size);
+int receive_msg_data(int fd, const struct iovec *iov, int iovcnt, uint32_t len);
+int discard_msg_data(int fd, uint32_t len);
+int recv_buffer_init(struct RecvBuffer *rb, size_t size);
+int recv_buffer_fill(int fd, struct RecvBuffer *rb);
+size_t recv_buffer_take(struct RecvBuffer *rb, void *dst, size_t len);
+int recv_buffer_discard(int fd, struct RecvBuffer *rb, uint32_t len);
+int decode_msg_headers(const uint8_t *buf, size_t len, struct Message *msgs,
+                size_t *data_at, int max);
 
 #endif
@@ -0,0 +1,791 @@
+/*
+ * lhbench: fio-style load generator and blktrace replayer for liblonghorn.
+ *
+ * Synthetic jobs:
+ *   lhbench --socket=/var/run/replica.sock --rw=randread --bs=4k \
+ *           --iodepth=16 --numjobs=4 --runtime=30 --size=1g
+ *
+ * Trace replay (blkparse text output, e.g. `blkparse -i sda -o trace.txt`):
+ *   lhbench --socket=/var/run/replica.sock --trace=trace.txt --iodepth=32
+ *
+ * Every job owns one connection and drives it from --iodepth threads, so
+ * the effective queue depth on the replica is numjobs * iodepth. With a
+ * trace every job replays all of it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "liblonghorn.h"
+
+#define SECTOR_SIZE             512
+#define TRACE_LINE_MAX          1024
+
+/*
+ * Latency histogram: 64 power-of-two groups with 16 linear buckets each,
+ * in nanoseconds.  Worst case relative error is 1/16.
+ */
+#define HIST_SUB_BITS           4
+#define HIST_SUB                (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            (64 * HIST_SUB)
+
+enum {
+        IO_READ = 0,
+        IO_WRITE,
+        IO_UNMAP,
+        IO_NR,
+};
+
+static const char *io_names[IO_NR] = { "read", "write", "unmap" };
+
+struct io_stats {
+        uint64_t ios;
+        uint64_t bytes;
+        uint64_t errors;
+        uint64_t lat_min;
+        uint64_t lat_max;
+        uint64_t lat_sum;
+        uint64_t hist[HIST_BUCKETS];
+};
+
+struct trace_record {
+        uint64_t time_ns;
+        uint64_t offset;
+        uint32_t len;
+        int type;
+};
+
+struct bench_options {
+        char *socket_path;
+        char *trace_path;
+        char *name;
+        int rw_random;
+        int rw_mix;               // -1 read only, -2 write only, else % reads
+        size_t bs;
+        int iodepth;
+        int numjobs;
+        int runtime;
+        uint64_t size;
+        int size_set;             // traces are only folded into --size
+        uint64_t offset;
+        int timeout;
+        int trace_timed;
+        double trace_speed;
+        int trace_loop;
+        int busy_poll_us;
+        int spin_us;
+        int response_cpu;
+        int numa_node;
+        int sender;
+        int unmap_window_us;
+};
+
+struct bench_job {
+        int id;
+        struct lh_client_conn *conn;
+        uint64_t seq_cursor;      // shared by the job's sequential workers
+        uint64_t trace_cursor;    // each job replays the whole trace
+        pthread_t *workers;
+        struct bench_worker *worker_ctx;
+};
+
+struct bench_worker {
+        struct bench_job *job;
+        int id;
+        uint64_t rand_state;
+        void *buf;
+        struct io_stats stats[IO_NR];
+};
+
+static struct bench_options opts = {
+        .rw_random = 0,
+        .rw_mix = -1,
+        .bs = 4096,
+        .iodepth = 1,
+        .numjobs = 1,
+        .runtime = 10,
+        .size = 1ULL << 30,
+        .offset = 0,
+        .timeout = 15,
+        .trace_timed = 1,
+        .trace_speed = 1.0,
+        .trace_loop = 0,
+        .busy_poll_us = 0,
+        .spin_us = 0,
+        .response_cpu = -1,
+        .numa_node = -1,
+        .sender = 0,
+        .unmap_window_us = 0,
+};
+
+static volatile int stop;
+static uint64_t budget_bytes;             // remaining IO when runtime=0
+
+static struct trace_record *trace;
+static size_t trace_len;
+static uint64_t trace_start_ns;
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rand_next(uint64_t *state) {
+        // xorshift64*
+        uint64_t x = *state;
+
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int parse_size(const char *str, uint64_t *out) {
+        char *end;
+        uint64_t v;
+
+        errno = 0;
+        v = strtoull(str, &end, 0);
+        if (errno != 0 || end == str) {
+                return -EINVAL;
+        }
+        switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        case 't': case 'T': v <<= 40; end++; break;
+        case '\0': break;
+        default: return -EINVAL;
+        }
+        if (*end == 'b' || *end == 'B') {
+                end++;
+        }
+        if (*end != '\0') {
+                return -EINVAL;
+        }
+        *out = v;
+        return 0;
+}
+
+static int hist_index(uint64_t v) {
+        int msb, shift;
+
+        if (v < HIST_SUB) {
+                return v;
+        }
+        msb = 63 - __builtin_clzll(v);
+        shift = msb - HIST_SUB_BITS;
+        return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int idx) {
+        int group = idx >> HIST_SUB_BITS;
+        uint64_t sub = idx & (HIST_SUB - 1);
+
+        if (group == 0) {
+                return sub;
+        }
+        return (HIST_SUB + sub) << (group - 1);
+}
+
+static void stats_add(struct io_stats *s, uint64_t lat, size_t bytes, int rc) {
+        if (rc < 0) {
+                s->errors++;
+                return;
+        }
+        s->ios++;
+        s->bytes += bytes;
+        s->lat_sum += lat;
+        if (s->lat_min == 0 || lat < s->lat_min) {
+                s->lat_min = lat;
+        }
+        if (lat > s->lat_max) {
+                s->lat_max = lat;
+        }
+        s->hist[hist_index(lat)]++;
+}
+
+static void stats_merge(struct io_stats *dst, struct io_stats *src) {
+        int i;
+
+        dst->ios += src->ios;
+        dst->bytes += src->bytes;
+        dst->errors += src->errors;
+        dst->lat_sum += src->lat_sum;
+        if (src->lat_min != 0 &&
+                        (dst->lat_min == 0 || src->lat_min < dst->lat_min)) {
+                dst->lat_min = src->lat_min;
+        }
+        if (src->lat_max > dst->lat_max) {
+                dst->lat_max = src->lat_max;
+        }
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                dst->hist[i] += src->hist[i];
+        }
+}
+
+static uint64_t stats_percentile(struct io_stats *s, double pct) {
+        uint64_t target = (uint64_t)(s->ios * pct / 100.0);
+        uint64_t seen = 0;
+        int i;
+
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                seen += s->hist[i];
+                if (seen > target) {
+                        return hist_value(i);
+                }
+        }
+        return s->lat_max;
+}
+
+static int do_io(struct lh_client_conn *conn, int type, void *buf, size_t len,
+                uint64_t offset) {
+        switch (type) {
+        case IO_READ:
+                return lh_client_read_at(conn, buf, len, offset);
+        case IO_WRITE:
+                return lh_client_write_at(conn, buf, len, offset);
+        case IO_UNMAP:
+                return lh_client_unmap(conn, NULL, len, offset);
+        }
+        return -EINVAL;
+}
+
+static int take_budget(size_t len) {
+        uint64_t left;
+
+        if (opts.runtime > 0) {
+                return 1;
+        }
+        do {
+                left = __atomic_load_n(&budget_bytes, __ATOMIC_RELAXED);
+                if (left == 0) {
+                        return 0;
+                }
+        } while (!__atomic_compare_exchange_n(&budget_bytes, &left,
+                                left > len ? left - len : 0, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return 1;
+}
+
+static void *synthetic_worker(void *arg) {
+        struct bench_worker *w = arg;
+        uint64_t blocks = opts.size / opts.bs;
+        uint64_t offset, start, lat;
+        int type, rc;
+
+        while (!stop && take_budget(opts.bs)) {
+                if (opts.rw_mix == -1) {
+                        type = IO_READ;
+                } else if (opts.rw_mix == -2) {
+                        type = IO_WRITE;
+                } else {
+                        type = (int)(rand_next(&w->rand_state) % 100) < opts.rw_mix ?
+                                IO_READ : IO_WRITE;
+                }
+
+                if (opts.rw_random) {
+                        offset = rand_next(&w->rand_state) % blocks;
+                } else {
+                        offset = __atomic_fetch_add(&w->job->seq_cursor, 1,
+                                        __ATOMIC_RELAXED) % blocks;
+                }
+                offset = opts.offset + offset * opts.bs;
+
+                start = now_ns();
+                rc = do_io(w->job->conn, type, w->buf, opts.bs, offset);
+                lat = now_ns() - start;
+                stats_add(&w->stats[type], lat, opts.bs, rc);
+                if (rc < 0 && !stop) {
+                        fprintf(stderr, "%s at offset %llu failed: %d\n",
+                                        io_names[type],
+                                        (unsigned long long)offset, rc);
+                }
+        }
+        return NULL;
+}
+
+static void sleep_until(uint64_t deadline) {
+        struct timespec ts;
+        uint64_t now = now_ns();
+
+        if (deadline <= now) {
+                return;
+        }
+        ts.tv_sec = (deadline - now) / 1000000000ULL;
+        ts.tv_nsec = (deadline - now) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+}
+
+static void *trace_worker(void *arg) {
+        struct bench_worker *w = arg;
+        struct trace_record *rec;
+        uint64_t idx, start, lat, loop;
+        uint64_t span = trace[trace_len - 1].time_ns + 1;
+        int rc;
+
+        while (!stop) {
+                idx = __atomic_fetch_add(&w->job->trace_cursor, 1, __ATOMIC_RELAXED);
+                loop = idx / trace_len;
+                if (loop > 0 && !opts.trace_loop) {
+                        break;
+                }
+                rec = &trace[idx % trace_len];
+
+                if (opts.trace_timed) {
+                        sleep_until(trace_start_ns + (uint64_t)
+                                        ((loop * span + rec->time_ns) / opts.trace_speed));
+                }
+
+                start = now_ns();
+                rc = do_io(w->job->conn, rec->type, w->buf, rec->len, rec->offset);
+                lat = now_ns() - start;
+                stats_add(&w->stats[rec->type], lat, rec->len, rc);
+                if (rc < 0 && !stop) {
+                        fprintf(stderr, "trace %s at offset %llu len %u failed: %d\n",
+                                        io_names[rec->type],
+                                        (unsigned long long)rec->offset,
+                                        rec->len, rc);
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Parse blkparse default text output.  A line looks like
+ *   8,0    3        1     0.000000000   697  Q  WS 223490 + 8 [kjournald]
+ * Only queue ('Q') events carrying a sector range are replayed.
+ */
+static int load_trace(const char *path, size_t *max_len) {
+        FILE *f;
+        char line[TRACE_LINE_MAX];
+        char dev[32], action[8], rwbs[16];
+        unsigned int cpu, pid;
+        unsigned long long seqno, sector, nsect;
+        double ts;
+        size_t cap = 0;
+        uint64_t first_ns = 0;
+        struct trace_record *rec;
+
+        f = fopen(path, "r");
+        if (f == NULL) {
+                fprintf(stderr, "cannot open trace %s: %s\n", path, strerror(errno));
+                return -errno;
+        }
+
+        *max_len = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+                if (sscanf(line, "%31s %u %llu %lf %u %7s %15s %llu + %llu",
+                                        dev, &cpu, &seqno, &ts, &pid,
+                                        action, rwbs, &sector, &nsect) != 9) {
+                        continue;
+                }
+                if (strcmp(action, "Q") != 0 || nsect == 0) {
+                        continue;
+                }
+
+                if (trace_len == cap) {
+                        cap = cap ? cap * 2 : 4096;
+                        rec = realloc(trace, cap * sizeof(*trace));
+                        if (rec == NULL) {
+                                fclose(f);
+                                return -ENOMEM;
+                        }
+                        trace = rec;
+                }
+                rec = &trace[trace_len];
+
+                if (strchr(rwbs, 'D') != NULL) {
+                        rec->type = IO_UNMAP;
+                } else if (strchr(rwbs, 'W') != NULL) {
+                        rec->type = IO_WRITE;
+                } else if (strchr(rwbs, 'R') != NULL) {
+                        rec->type = IO_READ;
+                } else {
+                        continue;
+                }
+
+                rec->time_ns = (uint64_t)(ts * 1e9);
+                if (trace_len == 0) {
+                        first_ns = rec->time_ns;
+                }
+                rec->time_ns = rec->time_ns > first_ns ? rec->time_ns - first_ns : 0;
+                rec->offset = opts.offset + sector * SECTOR_SIZE;
+                rec->len = nsect * SECTOR_SIZE;
+                if (opts.size_set && opts.size != 0) {
+                        // Keep the whole IO inside the region
+                        rec->offset = opts.offset;
+                        if (opts.size > rec->len) {
+                                rec->offset += (sector * SECTOR_SIZE) %
+                                        (opts.size - rec->len);
+                        }
+                }
+                if (rec->len > *max_len) {
+                        *max_len = rec->len;
+                }
+                trace_len++;
+        }
+        fclose(f);
+
+        if (trace_len == 0) {
+                fprintf(stderr, "no replayable events in trace %s\n", path);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+static void print_stats(const char *name, struct io_stats *s, double secs) {
+        if (s->ios == 0 && s->errors == 0) {
+                return;
+        }
+        printf("  %-5s: IOPS=%.0f, BW=%.1fMiB/s (%llu ios, %llu bytes, %llu errors)\n",
+                        name, s->ios / secs,
+                        s->bytes / secs / (1 << 20),
+                        (unsigned long long)s->ios,
+                        (unsigned long long)s->bytes,
+                        (unsigned long long)s->errors);
+        if (s->ios == 0) {
+                return;
+        }
+        printf("    lat (usec): min=%.1f, max=%.1f, avg=%.1f\n",
+                        s->lat_min / 1e3, s->lat_max / 1e3,
+                        (double)s->lat_sum / s->ios / 1e3);
+        printf("    clat percentiles (usec): 50th=%.1f, 90th=%.1f, 99th=%.1f, "
+                        "99.9th=%.1f, 99.99th=%.1f\n",
+                        stats_percentile(s, 50) / 1e3,
+                        stats_percentile(s, 90) / 1e3,
+                        stats_percentile(s, 99) / 1e3,
+                        stats_percentile(s, 99.9) / 1e3,
+                        stats_percentile(s, 99.99) / 1e3);
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s --socket=PATH [options]\n"
+                "  --name=NAME        label printed with the results\n"
+                "  --rw=MODE          read|write|randread|randwrite|rw|readwrite|randrw\n"
+                "  --rwmixread=PCT    read percentage for mixed jobs (default 50)\n"
+                "  --bs=SIZE          block size (default 4k)\n"
+                "  --iodepth=N        outstanding IOs per job (default 1)\n"
+                "  --numjobs=N        jobs, each with its own connection and, for\n"
+                "                     sequential modes, its own stream (default 1)\n"
+                "  --runtime=SEC      run time, 0 to do --size bytes per job (default 10)\n"
+                "  --size=SIZE        size of the IO region (default 1g); traces are\n"
+                "                     replayed at their own offsets unless it is given\n"
+                "  --offset=SIZE      start of the IO region (default 0)\n"
+                "  --timeout=SEC      request timeout (default 15)\n"
+                "  --trace=FILE       replay blkparse text output instead, in\n"
+                "                     full on every job\n"
+                "  --trace-speed=X    replay speed multiplier (default 1.0)\n"
+                "  --trace-afap       replay as fast as possible, ignoring timestamps\n"
+                "  --trace-loop       restart the trace until --runtime expires\n"
+                "  --busy-poll=USEC   response thread poll budget (default 0)\n"
+                "  --spin=USEC        callers poll for completion first (default 0)\n"
+                "  --response-cpu=N   pin each job's response thread to CPU N+job\n"
+                "  --numa-node=N      run connection threads and buffers on node N\n"
+                "  --sender           write requests from a sender thread\n"
+                "  --unmap-window=USEC coalesce unmaps over this window (default 0)\n",
+                prog);
+}
+
+static int parse_rw(const char *mode) {
+        if (strcmp(mode, "read") == 0) {
+                opts.rw_random = 0; opts.rw_mix = -1;
+        } else if (strcmp(mode, "write") == 0) {
+                opts.rw_random = 0; opts.rw_mix = -2;
+        } else if (strcmp(mode, "randread") == 0) {
+                opts.rw_random = 1; opts.rw_mix = -1;
+        } else if (strcmp(mode, "randwrite") == 0) {
+                opts.rw_random = 1; opts.rw_mix = -2;
+        } else if (strcmp(mode, "rw") == 0 || strcmp(mode, "readwrite") == 0) {
+                opts.rw_random = 0; opts.rw_mix = 50;
+        } else if (strcmp(mode, "randrw") == 0) {
+                opts.rw_random = 1; opts.rw_mix = 50;
+        } else {
+                return -EINVAL;
+        }
+        return 0;
+}
+
+static int parse_options(int argc, char *argv[]) {
+        static struct option long_options[] = {
+                {"socket",      required_argument, 0, 's'},
+                {"rw",          required_argument, 0, 'r'},
+                {"readwrite",   required_argument, 0, 'r'},
+                {"rwmixread",   required_argument, 0, 'm'},
+                {"bs",          required_argument, 0, 'b'},
+                {"iodepth",     required_argument, 0, 'q'},
+                {"numjobs",     required_argument, 0, 'j'},
+                {"runtime",     required_argument, 0, 't'},
+                {"size",        required_argument, 0, 'S'},
+                {"offset",      required_argument, 0, 'o'},
+                {"timeout",     required_argument, 0, 'T'},
+                {"trace",       required_argument, 0, 'f'},
+                {"trace-speed", required_argument, 0, 'x'},
+                {"trace-afap",  no_argument,       0, 'a'},
+                {"trace-loop",  no_argument,       0, 'l'},
+                {"name",        required_argument, 0, 'n'},
+                {"busy-poll",   required_argument, 0, 'B'},
+                {"spin",        required_argument, 0, 'P'},
+                {"response-cpu", required_argument, 0, 'C'},
+                {"numa-node",   required_argument, 0, 'N'},
+                {"sender",      no_argument,       0, 'W'},
+                {"unmap-window", required_argument, 0, 'U'},
+                {"help",        no_argument,       0, 'h'},
+                {0, 0, 0, 0}
+        };
+        int c, mix = 50, mix_set = 0;
+        uint64_t v;
+
+        while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+                switch (c) {
+                case 's':
+                        opts.socket_path = optarg;
+                        break;
+                case 'r':
+                        if (parse_rw(optarg) < 0) {
+                                fprintf(stderr, "invalid rw mode %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'm':
+                        mix = atoi(optarg);
+                        if (mix < 0 || mix > 100) {
+                                fprintf(stderr, "invalid rwmixread %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        mix_set = 1;
+                        break;
+                case 'b':
+                        if (parse_size(optarg, &v) < 0 || v == 0) {
+                                fprintf(stderr, "invalid bs %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        opts.bs = v;
+                        break;
+                case 'q':
+                        opts.iodepth = atoi(optarg);
+                        break;
+                case 'j':
+                        opts.numjobs = atoi(optarg);
+                        break;
+                case 't':
+                        opts.runtime = atoi(optarg);
+                        break;
+                case 'S':
+                        if (parse_size(optarg, &opts.size) < 0) {
+                                fprintf(stderr, "invalid size %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        opts.size_set = 1;
+                        break;
+                case 'o':
+                        if (parse_size(optarg, &opts.offset) < 0) {
+                                fprintf(stderr, "invalid offset %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'T':
+                        opts.timeout = atoi(optarg);
+                        break;
+                case 'f':
+                        opts.trace_path = optarg;
+                        break;
+                case 'x':
+                        opts.trace_speed = atof(optarg);
+                        break;
+                case 'a':
+                        opts.trace_timed = 0;
+                        break;
+                case 'l':
+                        opts.trace_loop = 1;
+                        break;
+                case 'n':
+                        opts.name = optarg;
+                        break;
+                case 'B':
+                        opts.busy_poll_us = atoi(optarg);
+                        break;
+                case 'P':
+                        opts.spin_us = atoi(optarg);
+                        break;
+                case 'C':
+                        opts.response_cpu = atoi(optarg);
+                        break;
+                case 'N':
+                        opts.numa_node = atoi(optarg);
+                        break;
+                case 'W':
+                        opts.sender = 1;
+                        break;
+                case 'U':
+                        opts.unmap_window_us = atoi(optarg);
+                        break;
+                default:
+                        return -EINVAL;
+                }
+        }
+
+        if (mix_set && opts.rw_mix >= 0) {
+                opts.rw_mix = mix;
+        }
+        if (opts.socket_path == NULL) {
+                fprintf(stderr, "--socket is required\n");
+                return -EINVAL;
+        }
+        if (opts.iodepth < 1 || opts.numjobs < 1 || opts.runtime < 0 ||
+                        opts.trace_speed <= 0) {
+                fprintf(stderr, "invalid job parameters\n");
+                return -EINVAL;
+        }
+        if (opts.trace_path == NULL && opts.size < opts.bs) {
+                fprintf(stderr, "size must be at least one block\n");
+                return -EINVAL;
+        }
+        if (opts.trace_loop && opts.runtime == 0) {
+                fprintf(stderr, "--trace-loop requires --runtime\n");
+                return -EINVAL;
+        }
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        struct bench_job *jobs;
+        struct io_stats total[IO_NR];
+        size_t buf_len = 0;
+        uint64_t start, elapsed;
+        int i, j, k, rc;
+
+        if (parse_options(argc, argv) < 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (opts.trace_path != NULL) {
+                if (load_trace(opts.trace_path, &buf_len) < 0) {
+                        return 1;
+                }
+                if (!opts.trace_loop && opts.runtime > 0) {
+                        // Runtime only bounds a looping replay
+                        opts.runtime = 0;
+                }
+        } else {
+                buf_len = opts.bs;
+                budget_bytes = opts.size * opts.numjobs;
+        }
+
+        jobs = calloc(opts.numjobs, sizeof(*jobs));
+        if (jobs == NULL) {
+                return 1;
+        }
+        for (i = 0; i < opts.numjobs; i++) {
+                jobs[i].id = i;
+                jobs[i].conn = lh_client_allocate_conn(opts.timeout);
+                if (jobs[i].conn == NULL) {
+                        fprintf(stderr, "cannot allocate connection\n");
+                        return 1;
+                }
+                if (lh_client_set_busy_poll(jobs[i].conn, opts.busy_poll_us) < 0 ||
+                                lh_client_set_completion_spin(jobs[i].conn, opts.spin_us) < 0 ||
+                                lh_client_set_sender_thread(jobs[i].conn, opts.sender) < 0 ||
+                                lh_client_set_unmap_coalescing(jobs[i].conn,
+                                        opts.unmap_window_us, 0) < 0 ||
+                                (opts.response_cpu >= 0 && lh_client_set_response_cpu(
+                                        jobs[i].conn, opts.response_cpu + i) < 0) ||
+                                (opts.numa_node >= 0 && lh_client_set_affinity(
+                                        jobs[i].conn, NULL, 0, opts.numa_node) < 0)) {
+                        fprintf(stderr, "invalid low latency options\n");
+                        return 1;
+                }
+                rc = lh_client_open_conn(jobs[i].conn, opts.socket_path);
+                if (rc < 0) {
+                        fprintf(stderr, "cannot connect to %s: %d\n",
+                                        opts.socket_path, rc);
+                        return 1;
+                }
+                jobs[i].workers = calloc(opts.iodepth, sizeof(pthread_t));
+                jobs[i].worker_ctx = calloc(opts.iodepth, sizeof(struct bench_worker));
+                if (jobs[i].workers == NULL || jobs[i].worker_ctx == NULL) {
+                        return 1;
+                }
+                for (j = 0; j < opts.iodepth; j++) {
+                        struct bench_worker *w = &jobs[i].worker_ctx[j];
+
+                        w->job = &jobs[i];
+                        w->id = j;
+                        w->rand_state = 0x9E3779B97F4A7C15ULL ^
+                                ((uint64_t)(i * opts.iodepth + j + 1) << 17) ^ now_ns();
+                        w->buf = lh_client_alloc_buffer(jobs[i].conn, buf_len);
+                        if (w->buf == NULL) {
+                                fprintf(stderr, "cannot allocate IO buffer\n");
+                                return 1;
+                        }
+                        memset(w->buf, 0xa5 ^ (i + j), buf_len);
+                }
+        }
+
+        printf("lhbench: %s%s%s, %d job(s) x iodepth %d against %s\n",
+                        opts.name ? opts.name : "", opts.name ? ": " : "",
+                        opts.trace_path ? "trace replay" : "synthetic",
+                        opts.numjobs, opts.iodepth, opts.socket_path);
+
+        start = now_ns();
+        trace_start_ns = start;
+        for (i = 0; i < opts.numjobs; i++) {
+                for (j = 0; j < opts.iodepth; j++) {
+                        rc = pthread_create(&jobs[i].workers[j], NULL,
+                                        opts.trace_path ? trace_worker : synthetic_worker,
+                                        &jobs[i].worker_ctx[j]);
+                        if (rc != 0) {
+                                fprintf(stderr, "cannot create worker: %d\n", rc);
+                                return 1;
+                        }
+                }
+        }
+
+        if (opts.runtime > 0) {
+                sleep_until(start + (uint64_t)opts.runtime * 1000000000ULL);
+                stop = 1;
+        }
+
+        memset(total, 0, sizeof(total));
+        for (i = 0; i < opts.numjobs; i++) {
+                for (j = 0; j < opts.iodepth; j++) {
+                        pthread_join(jobs[i].workers[j], NULL);
+                }
+        }
+        elapsed = now_ns() - start;
+
+        for (i = 0; i < opts.numjobs; i++) {
+                for (j = 0; j < opts.iodepth; j++) {
+                        for (k = 0; k < IO_NR; k++) {
+                                stats_merge(&total[k], &jobs[i].worker_ctx[j].stats[k]);
+                        }
+                        lh_client_free_buffer(jobs[i].conn, jobs[i].worker_ctx[j].buf);
+                }
+                lh_client_close_conn(jobs[i].conn);
+                lh_client_free_conn(jobs[i].conn);
+                free(jobs[i].workers);
+                free(jobs[i].worker_ctx);
+        }
+        free(jobs);
+        free(trace);
+
+        printf("run time: %.3f s\n", elapsed / 1e9);
+        for (k = 0; k < IO_NR; k++) {
+                print_stats(io_names[k], &total[k], elapsed / 1e9);
+        }
+        return 0;
+}